@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -62,6 +63,22 @@ bool Joystick::sample(JoystickEvent* event)
   return bytes == sizeof(*event);
 }
 
+int Joystick::sampleBatch(JoystickEvent* events, int maxEvents)
+{
+  int bytes = read(_fd, events, sizeof(*events) * maxEvents);
+
+  if (bytes == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  // The driver only returns whole events
+  return bytes / sizeof(*events);
+}
+
+int Joystick::getFileDescriptor() const
+{
+  return _fd;
+}
+
 bool Joystick::isFound()
 {
   return _fd >= 0;
@@ -149,6 +149,18 @@ public:
    * from the joystick. Returns true if data is available, otherwise false.
    */
   bool sample(JoystickEvent* event);
+
+  /**
+   * Reads all queued events, up to maxEvents, with a single read call.
+   * Returns the number of events read, 0 if none are available and -1 if
+   * the device failed (e.g. it was unplugged).
+   */
+  int sampleBatch(JoystickEvent* events, int maxEvents);
+
+  /**
+   * Returns the file descriptor of the device, for use with poll or epoll.
+   */
+  int getFileDescriptor() const;
 };
 
 #endif
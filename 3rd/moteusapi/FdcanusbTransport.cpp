@@ -0,0 +1,289 @@
+#include "FdcanusbTransport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const char kHex[] = "0123456789abcdef";
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+FdcanusbTransport::FdcanusbTransport(const string& dev_name,
+                                     const CanBitrates& bitrates)
+    : MoteusTransport(bitrates), dev_name_(dev_name) {
+  fd_ = open(dev_name_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd_ == -1) {
+    throw std::runtime_error("FdcanusbTransport: Unable to open port");
+  }
+
+  // Raw 8N1, the baud rate is ignored by the device
+  struct termios toptions;
+  if (tcgetattr(fd_, &toptions) < 0) {
+    close(fd_);
+    throw std::runtime_error("FdcanusbTransport: Couldn't get term attributes");
+  }
+  cfsetispeed(&toptions, B115200);
+  cfsetospeed(&toptions, B115200);
+  toptions.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS);
+  toptions.c_cflag |= CS8 | CREAD | CLOCAL;
+  toptions.c_iflag &= ~(IXON | IXOFF | IXANY);
+  toptions.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+  toptions.c_oflag &= ~OPOST;
+  toptions.c_cc[VMIN] = 0;
+  toptions.c_cc[VTIME] = 0;
+  if (tcsetattr(fd_, TCSAFLUSH, &toptions) < 0) {
+    close(fd_);
+    throw std::runtime_error("FdcanusbTransport: Couldn't set term attributes");
+  }
+
+  tx_.reserve(4096);
+  line_.reserve(256);
+  pending_.reserve(64);
+}
+
+FdcanusbTransport::~FdcanusbTransport() { close(fd_); }
+
+bool FdcanusbTransport::Send(const MoteusFrame* frames, size_t count,
+                             int64_t timeout_us) {
+  // Without Resync after a late Send, the new lines must not be joined
+  // to the fragment
+  TerminateLine();
+  if (cut_off_) {
+    return false;
+  }
+
+  tx_.clear();
+  tx_sizes_.clear();
+  for (size_t i = 0; i < count; i++) {
+    const MoteusFrame& frame = frames[i];
+    const int id = (frame.reply_required ? 0x8000 : 0) | frame.destination;
+
+    tx_ += "can send ";
+    for (int shift = 12; shift >= 0; shift -= 4) {
+      tx_ += kHex[(id >> shift) & 0x0f];
+    }
+    tx_ += ' ';
+    for (size_t j = 0; j < frame.can.size; j++) {
+      tx_ += kHex[frame.can.data[j] >> 4];
+      tx_ += kHex[frame.can.data[j] & 0x0f];
+    }
+    tx_ += '\n';
+    tx_sizes_.push_back(frame.can.size);
+  }
+
+  const int64_t deadline_us = NowUs() + timeout_us;
+
+  // All lines in one write, so the adapter can put them on the bus back
+  // to back
+  size_t written = 0;
+  bool failed = false;
+  while (written < tx_.size()) {
+    ssize_t n = write(fd_, tx_.data() + written, tx_.size() - written);
+    if (n > 0) {
+      written += n;
+      continue;
+    }
+    if ((n < 0 && errno != EAGAIN && errno != EINTR) ||
+        NowUs() > deadline_us) {
+      failed = true;
+      break;
+    }
+    pollfd pfd = {fd_, POLLOUT, 0};
+    poll(&pfd, 1, 1);
+  }
+
+  // Only complete lines reach the bus
+  size_t lines = 0;
+  for (size_t pos = 0; pos < written; pos++) {
+    if (tx_[pos] == '\n') CountFrame(tx_sizes_[lines++]);
+  }
+  if (failed) {
+    cut_off_ = written > 0 && tx_[written - 1] != '\n';
+    return false;
+  }
+
+  // One acknowledgement per line
+  size_t acknowledged = 0;
+  while (acknowledged < tx_sizes_.size()) {
+    if (!ReadLine(deadline_us)) {
+      return false;
+    }
+    if (line_.compare(0, 2, "OK") == 0) {
+      acknowledged++;
+    } else if (line_.compare(0, 3, "rcv") == 0) {
+      MoteusFrame frame;
+      if (ParseReply(line_, &frame)) {
+        CountFrame(frame.can.size);
+        pending_.push_back(frame);
+      }
+    } else if (line_.compare(0, 3, "ERR") == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void FdcanusbTransport::TerminateLine() {
+  if (!cut_off_) {
+    return;
+  }
+
+  // '!' is not valid wherever the line was cut. Retried by the next Send
+  // or Resync if the adapter does not take it within a millisecond; a
+  // repeated '!' is just as invalid.
+  const char terminator[] = "!\n";
+  size_t written = 0;
+  const int64_t deadline_us = NowUs() + 1000;
+  while (written < sizeof(terminator) - 1) {
+    ssize_t n = write(fd_, terminator + written,
+                      sizeof(terminator) - 1 - written);
+    if (n > 0) {
+      written += n;
+      continue;
+    }
+    if ((n < 0 && errno != EAGAIN && errno != EINTR) ||
+        NowUs() > deadline_us) {
+      break;
+    }
+    pollfd pfd = {fd_, POLLOUT, 0};
+    poll(&pfd, 1, 1);
+  }
+
+  if (written == sizeof(terminator) - 1) {
+    cut_off_ = false;
+    stale_errors_++;
+  }
+}
+
+void FdcanusbTransport::Resync() {
+  tcflush(fd_, TCIFLUSH);
+  rx_start_ = 0;
+  rx_end_ = 0;
+  pending_.clear();
+  pending_start_ = 0;
+
+  // After the flush, so the ERR reply arrives later and is skipped
+  TerminateLine();
+}
+
+int FdcanusbTransport::Receive(MoteusFrame* frames, size_t max_count,
+                               int64_t timeout_us) {
+  size_t stored = 0;
+  while (stored < max_count && pending_start_ < pending_.size()) {
+    frames[stored++] = pending_[pending_start_++];
+  }
+  if (pending_start_ == pending_.size()) {
+    pending_.clear();
+    pending_start_ = 0;
+  }
+
+  // Wait for the first reply only, then take what is already there
+  int64_t deadline_us = stored ? 0 : NowUs() + timeout_us;
+  while (stored < max_count && ReadLine(deadline_us)) {
+    if (ParseReply(line_, &frames[stored])) {
+      CountFrame(frames[stored].can.size);
+      stored++;
+      deadline_us = 0;
+    }
+  }
+  return stored;
+}
+
+bool FdcanusbTransport::ReadLine(int64_t deadline_us) {
+  while (true) {
+    char* end = static_cast<char*>(
+        memchr(rx_ + rx_start_, '\n', rx_end_ - rx_start_));
+    if (end) {
+      line_.assign(rx_ + rx_start_, end);
+      rx_start_ = end - rx_ + 1;
+      if (stale_errors_ > 0 && line_.compare(0, 3, "ERR") == 0) {
+        stale_errors_--;
+        continue;
+      }
+      return true;
+    }
+
+    // Keep the partial line at the start of the buffer, a line that does
+    // not fit is garbage and dropped
+    memmove(rx_, rx_ + rx_start_, rx_end_ - rx_start_);
+    rx_end_ -= rx_start_;
+    rx_start_ = 0;
+    if (rx_end_ == sizeof(rx_)) {
+      rx_end_ = 0;
+    }
+
+    ssize_t n = read(fd_, rx_ + rx_end_, sizeof(rx_) - rx_end_);
+    if (n > 0) {
+      rx_end_ += n;
+      continue;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      return false;
+    }
+
+    const int64_t remaining_us = deadline_us - NowUs();
+    if (remaining_us <= 0) {
+      return false;
+    }
+    pollfd pfd = {fd_, POLLIN, 0};
+    timespec timeout = {static_cast<time_t>(remaining_us / 1000000),
+                        static_cast<long>(remaining_us % 1000000) * 1000};
+    ppoll(&pfd, 1, &timeout, nullptr);
+  }
+}
+
+bool FdcanusbTransport::ParseReply(const string& line,
+                                   MoteusFrame* frame) const {
+  // rcv <id> <data> [flags]
+  if (line.compare(0, 4, "rcv ") != 0) {
+    return false;
+  }
+
+  size_t pos = 4;
+  uint32_t id = 0;
+  for (; pos < line.size() && line[pos] != ' '; pos++) {
+    const int value = HexValue(line[pos]);
+    if (value < 0) return false;
+    id = (id << 4) | value;
+  }
+
+  pos++;
+  uint8_t size = 0;
+  while (pos + 1 < line.size() && line[pos] != ' ' &&
+         size < sizeof(frame->can.data)) {
+    const int high = HexValue(line[pos]);
+    const int low = HexValue(line[pos + 1]);
+    if (high < 0 || low < 0) break;
+    frame->can.data[size++] = (high << 4) | low;
+    pos += 2;
+  }
+
+  frame->source = (id >> 8) & 0x7f;
+  frame->destination = id & 0x7f;
+  frame->reply_required = (id & 0x8000) != 0;
+  frame->can.size = size;
+  return true;
+}
@@ -0,0 +1,60 @@
+#ifndef FDCANUSBTRANSPORT_H__
+#define FDCANUSBTRANSPORT_H__
+
+#include <string>
+#include <vector>
+
+#include "MoteusTransport.h"
+
+using namespace std;
+
+// The fdcanusb text protocol over its tty. A batch of frames is written
+// as "can send" lines in one write and then acknowledged line by line,
+// replies arriving meanwhile are kept for Receive. Input is parsed line by
+// line, so after Resync, which drops everything received so far, parsing
+// picks up again at the next complete line. A line cut off by the
+// deadline is terminated by Resync, or the next Send, with a character
+// the adapter cannot parse, so it rejects the stale fragment instead of
+// sending it late or joining it with the next line, and its ERR reply is
+// discarded.
+class FdcanusbTransport : public MoteusTransport {
+ public:
+  // bitrates as configured on the fdcanusb, for bus time accounting
+  explicit FdcanusbTransport(const string& dev_name,
+                             const CanBitrates& bitrates = CanBitrates());
+  ~FdcanusbTransport();
+
+  bool Send(const MoteusFrame* frames, size_t count,
+            int64_t timeout_us) override;
+  int Receive(MoteusFrame* frames, size_t max_count,
+              int64_t timeout_us) override;
+  void Resync() override;
+
+ private:
+  // Reads the next line into line_, waiting until deadline_us at most.
+  // The ERR replies to terminated fragments are skipped.
+  bool ReadLine(int64_t deadline_us);
+  // Ends a line cut off by the deadline so the adapter rejects it
+  void TerminateLine();
+  // Decodes an rcv line into frame
+  bool ParseReply(const string& line, MoteusFrame* frame) const;
+
+  const string dev_name_;
+  int fd_;
+  string tx_;
+  // Frame size of each line of tx_, for bus time accounting
+  vector<uint8_t> tx_sizes_;
+  // A line was cut off by the deadline and is not terminated yet
+  bool cut_off_ = false;
+  // ERR replies to terminated fragments not read yet
+  size_t stale_errors_ = 0;
+  string line_;
+  char rx_[4096];
+  size_t rx_start_ = 0;
+  size_t rx_end_ = 0;
+  // Replies read while waiting for acknowledgements
+  vector<MoteusFrame> pending_;
+  size_t pending_start_ = 0;
+};
+
+#endif  // FDCANUSBTRANSPORT_H__
@@ -16,24 +16,40 @@
 
 #include <errno.h>   // Error number definitions
 #include <fcntl.h>   // File control definitions
+#include <poll.h>
 #include <stdio.h>   // Standard input/output definitions
 #include <string.h>  // String function definitions
 #include <sys/ioctl.h>
 #include <termios.h>  // POSIX terminal control definitions
 #include <unistd.h>   // UNIX standard function definitions
 
+namespace {
+
+int64_t MonotonicUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
 MoteusAPI::MoteusAPI(const string dev_name, int moteus_id)
     : dev_name_(dev_name), moteus_id_(moteus_id) {
   OpenDev();
 }
 
-MoteusAPI::~MoteusAPI() { CloseDev(); }
+MoteusAPI::MoteusAPI(shared_ptr<MoteusTransport> transport, int moteus_id)
+    : moteus_id_(moteus_id), transport_(transport) {}
+
+MoteusAPI::~MoteusAPI() {
+  if (fd_ >= 0) CloseDev();
+}
 
 bool MoteusAPI::SendPositionCommand(double stop_position, double velocity,
                                     double max_torque,
                                     double feedforward_torque, double kp_scale,
                                     double kd_scale, double position,
-                                    double watchdog_timer) const {
+                                    double watchdog_timer, bool reply) const {
   mjbots::moteus::PositionCommand p_com;
   p_com.position = position;
   p_com.velocity = velocity;
@@ -48,57 +64,22 @@ bool MoteusAPI::SendPositionCommand(double stop_position, double velocity,
   mjbots::moteus::PositionResolution pres;
   mjbots::moteus::EmitPositionCommand(&write_frame, p_com, pres);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendFrame(frame, nullptr, reply);
 }
 
-bool MoteusAPI::SendStopCommand() {
+bool MoteusAPI::SendStopCommand(bool reply) {
   mjbots::moteus::CanFrame frame;
   mjbots::moteus::WriteCanFrame write_frame(&frame);
   mjbots::moteus::EmitStopCommand(&write_frame);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendFrame(frame, nullptr, reply);
 }
 
 bool MoteusAPI::SendWithinCommand(double bounds_min, double bounds_max,
                                   double feedforward_torque, double kp_scale,
                                   double kd_scale, double max_torque,
-                                  double stop_position, double timeout) const {
+                                  double stop_position, double timeout,
+                                  bool reply) const {
   mjbots::moteus::WithinCommand p_com;
   p_com.bounds_min = bounds_min;
   p_com.bounds_max = bounds_max;
@@ -114,25 +95,7 @@ bool MoteusAPI::SendWithinCommand(double bounds_min, double bounds_max,
   mjbots::moteus::WithinResolution pres;
   mjbots::moteus::EmitWithinCommand(&write_frame, p_com, pres);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendFrame(frame, nullptr, reply);
 }
 
 void MoteusAPI::ReadState(State& curr_state) const {
@@ -159,10 +122,69 @@ void MoteusAPI::ReadState(State& curr_state) const {
   mjbots::moteus::CanFrame frame;
   mjbots::moteus::WriteCanFrame wcan_frame(&frame);
   mjbots::moteus::EmitQueryCommand(&wcan_frame, q_com);
-  // Encode message to hex
+
+  mjbots::moteus::CanFrame reply_frame;
+  if (!SendFrame(frame, &reply_frame)) {
+    return;
+  }
+
+  mjbots::moteus::QueryState qs =
+      mjbots::moteus::ParseQueryState(reply_frame.data, reply_frame.size);
+  curr_state.position = qs.position;
+  curr_state.velocity = qs.velocity;
+  curr_state.torque = qs.torque;
+  curr_state.q_curr = qs.q_current;
+  curr_state.d_curr = qs.d_current;
+  curr_state.voltage = qs.voltage;
+  curr_state.temperature = qs.temperature;
+  curr_state.fault = qs.fault;
+  curr_state.mode = qs.mode;
+  curr_state.rezero_state = qs.rezero_state;
+}
+
+bool MoteusAPI::SendRegisterCommand(
+    const vector<mjbots::moteus::RegisterAccess>& writes,
+    vector<mjbots::moteus::RegisterAccess>* reads) const {
+  mjbots::moteus::CanFrame frame;
+  mjbots::moteus::WriteCanFrame write_frame(&frame);
+  mjbots::moteus::EmitWriteRegisters(&write_frame, writes.data(),
+                                     writes.size());
+  if (reads) {
+    mjbots::moteus::EmitReadRegisters(&write_frame, reads->data(),
+                                      reads->size());
+  }
+
+  mjbots::moteus::CanFrame reply_frame;
+  if (!SendFrame(frame, &reply_frame)) {
+    return false;
+  }
+
+  if (reads) {
+    mjbots::moteus::ParseRegisterReply(reply_frame.data, reply_frame.size,
+                                       reads->data(), reads->size());
+  }
+  return true;
+}
+
+bool MoteusAPI::SendFrame(const mjbots::moteus::CanFrame& frame,
+                          mjbots::moteus::CanFrame* reply_frame,
+                          bool reply) const {
+  if (transport_) {
+    return SendTransportFrame(frame, reply_frame, reply);
+  }
+
+  // Lines left over from a command that timed out must not be taken for
+  // responses to this one
+  if (resync_) {
+    tcflush(fd_, TCIFLUSH);
+    resync_ = false;
+  }
+  const int64_t deadline_us = MonotonicUs() + timeout_us_;
+
+  // Encode message to hex, the 0x8000 bit of the ID requests a reply
   stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
+  ss << "can send " << (reply ? "80" : "00") << std::setfill('0')
+     << std::setw(2) << std::hex << moteus_id_ << " ";
   for (uint ii = 0; ii < (uint)frame.size; ii++) {
     ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
   }
@@ -171,53 +193,98 @@ void MoteusAPI::ReadState(State& curr_state) const {
   if (!WriteDev(ss.str()))
     throw std::runtime_error("Failiur: could not WriteDev.");
 
+  // process response
   string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return;
+  if (!reply) {
+    return ExpectResponse("OK", resp, deadline_us);
+  }
+  if (!ExpectResponse("OK", resp, deadline_us) ||
+      !ExpectResponse("rcv", resp, deadline_us)) {
+    return false;
+  }
+  if (reply_frame) {
+    DecodeReply(resp, reply_frame);
   }
-  // cout << "resp is :" << resp << endl;
+  return true;
+}
 
+bool MoteusAPI::SendTransportFrame(const mjbots::moteus::CanFrame& frame,
+                                   mjbots::moteus::CanFrame* reply_frame,
+                                   bool reply) const {
+  if (resync_) {
+    transport_->Resync();
+    resync_ = false;
+  }
+  const int64_t deadline_us = MonotonicUs() + timeout_us_;
+
+  MoteusFrame out;
+  out.destination = moteus_id_;
+  out.reply_required = reply;
+  out.can = frame;
+  if (!transport_->Send(&out, 1, timeout_us_)) {
+    cout << "Timeout: Frame to " << moteus_id_ << " was not sent" << endl;
+    resync_ = true;
+    return false;
+  }
+  if (!reply) {
+    return true;
+  }
+
+  // Replies of other controllers on the bus are discarded, they were
+  // requested by someone else
+  MoteusFrame in;
+  while (true) {
+    const int64_t remaining_us = deadline_us - MonotonicUs();
+    if (remaining_us <= 0 || transport_->Receive(&in, 1, remaining_us) <= 0) {
+      cout << "Timeout: Expected reply from " << moteus_id_
+           << " was not received" << endl;
+      resync_ = true;
+      return false;
+    }
+    if (in.source == moteus_id_) {
+      break;
+    }
+  }
+  if (reply_frame) {
+    *reply_frame = in.can;
+  }
+  return true;
+}
+
+void MoteusAPI::DecodeReply(const string& resp,
+                            mjbots::moteus::CanFrame* reply_frame) const {
   /// parse response
   istringstream iss(resp);
   vector<string> words;
   copy(istream_iterator<string>(iss), istream_iterator<string>(),
        back_inserter(words));
 
-  uint8_t decoded[readbuffsize];
   string respstr(words.at(2));
-  uint loopsize = respstr.size() / 2;
+  size_t loopsize =
+      std::min<size_t>(respstr.size() / 2, sizeof(reply_frame->data));
 
   for (uint ii = 0; ii < loopsize; ii++) {
     std::stringstream stream;
     stream << respstr.substr(ii * 2, 2);
     int tmp;
     stream >> std::hex >> tmp;
-    decoded[ii] = (uint8_t)tmp;
+    reply_frame->data[ii] = (uint8_t)tmp;
   }
-
-  mjbots::moteus::QueryResult qr =
-      mjbots::moteus::ParseQueryResult(decoded, loopsize);
-  curr_state.position = qr.position;
-  curr_state.velocity = qr.velocity;
-  curr_state.torque = qr.torque;
-  curr_state.q_curr = qr.q_current;
-  curr_state.d_curr = qr.d_current;
-  curr_state.voltage = qr.voltage;
-  curr_state.temperature = qr.temperature;
-  curr_state.fault = qr.fault;
+  reply_frame->size = loopsize;
 }
 
-bool MoteusAPI::ExpectResponse(const string& exp_string,
-                               string& fullresp) const {
+bool MoteusAPI::ExpectResponse(const string& exp_string, string& fullresp,
+                               int64_t deadline_us) const {
   char read_buff[readbuffsize];
   for (uint ii = 0; ii < readbuffsize; ii++) {
     read_buff[ii] = 0;
   }
   do {
-    int res = ReadUntilDev(read_buff, '\n', readbuffsize, 1000);
+    int res = ReadUntilDev(read_buff, '\n', readbuffsize - 1, deadline_us);
     if (res) {
       cout << "Timeout: Expected response'" << exp_string
            << "' was not received" << endl;
+      resync_ = true;
       return false;
     }
     fullresp = string(read_buff);
@@ -284,22 +351,27 @@ bool MoteusAPI::WriteDev(const string& buff) const {
 int MoteusAPI::CloseDev() const { return close(fd_); }
 
 int MoteusAPI::ReadUntilDev(char* buf, char until, int buf_max,
-                            int timeout) const {
+                            int64_t deadline_us) const {
   char b[1];  // read expects an array, so we give it a 1-byte array
   int i = 0;
   do {
     int n = read(fd_, b, 1);  // read a char at a time
-    if (n == -1) return -1;   // couldn't read
-    if (n == 0) {
-      usleep(1 * 1000);  // wait 1 msec try again
-      timeout--;
-      if (timeout == 0) return -2;
+    if (n == -1 && errno != EAGAIN) return -1;  // couldn't read
+    if (n <= 0) {
+      // wait for more input until the deadline
+      const int64_t remaining_us = deadline_us - MonotonicUs();
+      if (remaining_us <= 0) return -2;
+      struct pollfd pfd = {fd_, POLLIN, 0};
+      struct timespec timeout = {
+          static_cast<time_t>(remaining_us / 1000000),
+          static_cast<long>(remaining_us % 1000000) * 1000};
+      ppoll(&pfd, 1, &timeout, nullptr);
       continue;
     }
     buf[i] = b[0];
     i++;
-  } while (b[0] != until && i < buf_max && timeout > 0);
+  } while (b[0] != until && i < buf_max);
 
   buf[i] = 0;  // null terminate the string
   return 0;
-}
\ No newline at end of file
+}
@@ -21,12 +21,14 @@
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "MoteusTransport.h"
 #include "moteus_protocol.h"
 
 using namespace std;
@@ -109,38 +111,80 @@ struct State {
   }
 };
 
+// Commands a single moteus controller, one round trip per command. This
+// is the library API for tools talking to one controller, either through
+// an fdcanusb device path or through any MoteusTransport; the subscriber
+// drives its motors through MoteusGroup instead.
 class MoteusAPI {
  public:
   MoteusAPI(const string dev_name, int moteus_id);
+  // Talks to the controller through a transport, e.g. SocketCAN, which
+  // may be shared by the controllers of one bus
+  MoteusAPI(shared_ptr<MoteusTransport> transport, int moteus_id);
   ~MoteusAPI();
 
   bool SendPositionCommand(double stop_position, double velocity,
                            double max_torque, double feedforward_torque = 0,
                            double kp_scale = 1.0, double kd_scale = 1.0,
                            double position = NAN,
-                           double watchdog_timer = NAN) const;
+                           double watchdog_timer = NAN,
+                           bool reply = true) const;
   bool SendWithinCommand(double bounds_min, double bounds_max,
                          double feedforward_torque, double kp_scale,
                          double kd_scale, double max_torque,
                          double stop_position = NAN,
-                         double timeout = NAN) const;
+                         double timeout = NAN, bool reply = true) const;
 
-  bool SendStopCommand();
+  // With reply false, commands are sent without the reply bit and only
+  // wait for the fdcanusb to acknowledge them, which saves the reply
+  // frame on the bus and its wait.
+  bool SendStopCommand(bool reply = true);
+
+  // Each command waits up to timeout_us for all of its responses, 1 s by
+  // default. A command that misses it fails, and input left over from it
+  // is discarded before the next command. MoteusGroup takes its deadline
+  // per cycle instead.
+  void SetTimeout(int64_t timeout_us) { timeout_us_ = timeout_us; }
 
   void ReadState(State& curr_state) const;
 
+  // Writes and reads arbitrary registers in one frame and round trip,
+  // e.g. a command together with the telemetry of the cycle. Both lists
+  // must be sorted by register. Read values are NaN if missing from the
+  // reply.
+  bool SendRegisterCommand(
+      const vector<mjbots::moteus::RegisterAccess>& writes,
+      vector<mjbots::moteus::RegisterAccess>* reads = nullptr) const;
+
  private:
   // Open /dev/dev_name_
   int OpenDev();
   int CloseDev() const;
   bool WriteDev(const string& buff) const;
-  int ReadUntilDev(char* buf, char until, int buf_max, int timeout) const;
-  bool ExpectResponse(const string& exp_string, string& resp) const;
+  int ReadUntilDev(char* buf, char until, int buf_max,
+                   int64_t deadline_us) const;
+  bool ExpectResponse(const string& exp_string, string& resp,
+                      int64_t deadline_us) const;
+  // Sends frame and waits for the reply, or with reply false only for
+  // the adapter's acknowledgement. The reply data is stored in
+  // reply_frame if given.
+  bool SendFrame(const mjbots::moteus::CanFrame& frame,
+                 mjbots::moteus::CanFrame* reply_frame = nullptr,
+                 bool reply = true) const;
+  bool SendTransportFrame(const mjbots::moteus::CanFrame& frame,
+                          mjbots::moteus::CanFrame* reply_frame,
+                          bool reply) const;
+  // Decodes the data of an rcv reply into reply_frame
+  void DecodeReply(const string& resp,
+                   mjbots::moteus::CanFrame* reply_frame) const;
   const string dev_name_;
   const int moteus_id_;
-  int fd_;
+  int fd_ = -1;
+  shared_ptr<MoteusTransport> transport_;
+  int64_t timeout_us_ = 1000000;
+  // Set when a command missed its deadline
+  mutable bool resync_ = false;
   const unsigned int readbuffsize = 500;
-  // const unsigned long timeoutdelayus = 1000;
 };
 
 #endif  // MOTEUSAPI_H__
\ No newline at end of file
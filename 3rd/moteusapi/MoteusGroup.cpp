@@ -0,0 +1,310 @@
+#include "MoteusGroup.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+MoteusGroup::MoteusGroup(const vector<Servo>& servos, const Options& options)
+    : servos_(servos),
+      options_(options),
+      commands_(servos.size()),
+      states_(servos.size()),
+      ok_(servos.size()),
+      reply_time_us_(servos.size()) {
+  for (size_t i = 0; i < servos_.size(); i++) {
+    extra_.insert(extra_.end(), options_.extra_reads.begin(),
+                  options_.extra_reads.end());
+  }
+
+  // The reply carries the queried registers in the same blocks as the
+  // query, with their values
+  const mjbots::moteus::QueryCommand& query = options_.query;
+  const mjbots::moteus::RegisterAccess registers[] = {
+      {mjbots::moteus::Register::kMode, query.mode},
+      {mjbots::moteus::Register::kPosition, query.position},
+      {mjbots::moteus::Register::kVelocity, query.velocity},
+      {mjbots::moteus::Register::kTorque, query.torque},
+      {mjbots::moteus::Register::kQCurrent, query.q_current},
+      {mjbots::moteus::Register::kDCurrent, query.d_current},
+      {mjbots::moteus::Register::kRezeroState, query.rezero_state},
+      {mjbots::moteus::Register::kVoltage, query.voltage},
+      {mjbots::moteus::Register::kTemperature, query.temperature},
+      {mjbots::moteus::Register::kFault, query.fault},
+  };
+  vector<mjbots::moteus::RegisterAccess> replied;
+  for (const mjbots::moteus::RegisterAccess& access : registers) {
+    if (access.resolution != mjbots::moteus::Resolution::kIgnore) {
+      replied.push_back(access);
+      replied.back().value = 0;
+    }
+  }
+  mjbots::moteus::CanFrame reply;
+  mjbots::moteus::WriteCanFrame reply_frame(&reply);
+  mjbots::moteus::detail::EmitRegisterAccesses(
+      &reply_frame, mjbots::moteus::Multiplex::kReplyBase, replied.data(),
+      replied.size(), true);
+  if (!options_.extra_reads.empty()) {
+    mjbots::moteus::detail::EmitRegisterAccesses(
+        &reply_frame, mjbots::moteus::Multiplex::kReplyBase,
+        options_.extra_reads.data(), options_.extra_reads.size(), true);
+  }
+  reply_size_ = reply.size;
+
+  // Appended to the commands of cycles with reply
+  mjbots::moteus::WriteCanFrame query_frame(&query_);
+  mjbots::moteus::EmitQueryCommand(&query_frame, options_.query);
+  if (!options_.extra_reads.empty()) {
+    mjbots::moteus::EmitReadRegisters(&query_frame,
+                                      options_.extra_reads.data(),
+                                      options_.extra_reads.size());
+  }
+
+  for (size_t i = 0; i < servos_.size(); i++) {
+    const Servo& servo = servos_[i];
+    if (!servo.transport || servo.id < 1 || servo.id > 127) {
+      throw std::invalid_argument("MoteusGroup: Invalid servo");
+    }
+
+    size_t b = 0;
+    while (b < buses_.size() && buses_[b].transport != servo.transport) b++;
+    if (b == buses_.size()) {
+      buses_.emplace_back();
+      buses_[b].transport = servo.transport;
+      buses_[b].index.fill(-1);
+    }
+
+    Bus& bus = buses_[b];
+    if (bus.index[servo.id] >= 0) {
+      throw std::invalid_argument("MoteusGroup: Duplicate servo ID");
+    }
+    bus.index[servo.id] = i;
+    bus.servos.push_back(i);
+    bus.tx.resize(bus.servos.size());
+    bus.rx.resize(bus.servos.size());
+
+    SetStopCommand(i);
+  }
+
+  if (!options_.bus_threads) {
+    return;
+  }
+  for (size_t b = 0; b < buses_.size(); b++) {
+    threads_.emplace_back(&MoteusGroup::BusThread, this, b);
+
+    if (!options_.cpus.empty()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(options_.cpus[b % options_.cpus.size()], &cpus);
+      if (pthread_setaffinity_np(threads_[b].native_handle(), sizeof(cpus),
+                                 &cpus) != 0) {
+        cout << "MoteusGroup: Unable to pin bus " << b << " to CPU "
+             << options_.cpus[b % options_.cpus.size()] << endl;
+      }
+    }
+  }
+}
+
+MoteusGroup::~MoteusGroup() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void MoteusGroup::SetPositionCommand(
+    size_t i, const mjbots::moteus::PositionCommand& command) {
+  commands_[i] = mjbots::moteus::CanFrame();
+  mjbots::moteus::WriteCanFrame write_frame(&commands_[i]);
+  mjbots::moteus::EmitPositionCommand(&write_frame, command,
+                                      options_.position_resolution);
+  CheckCommandSize(i);
+}
+
+void MoteusGroup::SetStopCommand(size_t i) {
+  commands_[i] = mjbots::moteus::CanFrame();
+  mjbots::moteus::WriteCanFrame write_frame(&commands_[i]);
+  mjbots::moteus::EmitStopCommand(&write_frame);
+  CheckCommandSize(i);
+}
+
+void MoteusGroup::CheckCommandSize(size_t i) const {
+  if (commands_[i].size + query_.size > sizeof(query_.data)) {
+    throw std::runtime_error(
+        "MoteusGroup: Command and query do not fit into a frame");
+  }
+}
+
+size_t MoteusGroup::Cycle(bool reply, int64_t timeout_us) {
+  std::fill(ok_.begin(), ok_.end(), 0);
+  cycle_start_us_ = NowUs();
+  const int64_t deadline_us =
+      cycle_start_us_ +
+      (timeout_us < 0 ? options_.cycle_timeout_us : timeout_us);
+
+  if (!threads_.empty()) {
+    // Release all I/O threads and wait for the last one
+    std::unique_lock<std::mutex> lock(mutex_);
+    cycle_reply_ = reply;
+    cycle_deadline_us_ = deadline_us;
+    running_ = threads_.size();
+    generation_++;
+    start_cv_.notify_all();
+    done_cv_.wait(lock, [this]() { return running_ == 0; });
+  } else {
+    // Commands of all buses go out before waiting for any reply, the
+    // replies of the other buses queue up in their transports meanwhile
+    for (Bus& bus : buses_) {
+      SendBus(bus, reply, deadline_us);
+    }
+    for (Bus& bus : buses_) {
+      CollectBus(bus, deadline_us);
+    }
+  }
+
+  size_t completed = 0;
+  deadline_missed_ = false;
+  for (Bus& bus : buses_) {
+    completed += bus.completed;
+    deadline_missed_ |= bus.late;
+
+    const double total_time_us = bus.transport->bus_time_us();
+    bus.cycle_time_us = total_time_us - bus.total_time_us;
+    bus.total_time_us = total_time_us;
+  }
+  total_deadline_misses_ += deadline_missed_;
+
+  const int64_t cycle_time_us = NowUs() - cycle_start_us_;
+  for (size_t i = 0; i < servos_.size(); i++) {
+    if (!ok_[i]) reply_time_us_[i] = cycle_time_us;
+  }
+  return completed;
+}
+
+double MoteusGroup::EstimateBusTimeUs(size_t b, bool reply) const {
+  const Bus& bus = buses_[b];
+  const CanBitrates& bitrates = bus.transport->bitrates();
+  double time_us = 0;
+  for (size_t i : bus.servos) {
+    if (reply) {
+      time_us += CanFdFrameTimeUs(commands_[i].size + query_.size, bitrates);
+      time_us += CanFdFrameTimeUs(reply_size_, bitrates);
+    } else {
+      time_us += CanFdFrameTimeUs(commands_[i].size, bitrates);
+    }
+  }
+  return time_us;
+}
+
+void MoteusGroup::SendBus(Bus& bus, bool reply, int64_t deadline_us) {
+  // Drop what is left of an abandoned cycle, so its late replies are not
+  // taken for replies of this one
+  if (bus.late) {
+    bus.transport->Resync();
+    bus.late = false;
+  }
+
+  for (size_t k = 0; k < bus.servos.size(); k++) {
+    MoteusFrame& frame = bus.tx[k];
+    frame.destination = servos_[bus.servos[k]].id;
+    frame.reply_required = reply;
+    frame.can = commands_[bus.servos[k]];
+    if (reply) {
+      std::memcpy(frame.can.data + frame.can.size, query_.data, query_.size);
+      frame.can.size += query_.size;
+    }
+  }
+  const bool sent = bus.transport->Send(bus.tx.data(), bus.tx.size(),
+                                        deadline_us - NowUs());
+  bus.late = !sent;
+  bus.missing = sent && reply ? bus.servos.size() : 0;
+  bus.completed = 0;
+  if (sent && !reply) {
+    const int64_t sent_us = NowUs() - cycle_start_us_;
+    for (size_t i : bus.servos) {
+      ok_[i] = 1;
+      reply_time_us_[i] = sent_us;
+    }
+    bus.completed = bus.servos.size();
+  }
+}
+
+void MoteusGroup::CollectBus(Bus& bus, int64_t deadline_us) {
+  while (bus.missing > 0) {
+    const int64_t remaining_us = deadline_us - NowUs();
+    int count = remaining_us > 0 ? bus.transport->Receive(
+                                       bus.rx.data(), bus.rx.size(),
+                                       remaining_us)
+                                 : 0;
+    if (count <= 0) {
+      bus.late = true;
+      break;
+    }
+    const int64_t received_us = NowUs() - cycle_start_us_;
+
+    for (int k = 0; k < count; k++) {
+      const MoteusFrame& frame = bus.rx[k];
+      const int i = bus.index[frame.source & 0x7f];
+      if (i < 0 || ok_[i]) continue;
+
+      states_[i] =
+          mjbots::moteus::ParseQueryState(frame.can.data, frame.can.size);
+      if (!options_.extra_reads.empty()) {
+        mjbots::moteus::ParseRegisterReply(
+            frame.can.data, frame.can.size,
+            &extra_[i * options_.extra_reads.size()],
+            options_.extra_reads.size());
+      }
+      ok_[i] = 1;
+      reply_time_us_[i] = received_us;
+      bus.missing--;
+      bus.completed++;
+    }
+  }
+}
+
+void MoteusGroup::BusThread(size_t b) {
+  Bus& bus = buses_[b];
+  uint64_t generation = 0;
+
+  while (true) {
+    bool reply;
+    int64_t deadline_us;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, [&]() {
+        return stopping_ || generation_ != generation;
+      });
+      if (stopping_) return;
+      generation = generation_;
+      reply = cycle_reply_;
+      deadline_us = cycle_deadline_us_;
+    }
+
+    SendBus(bus, reply, deadline_us);
+    CollectBus(bus, deadline_us);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--running_ == 0) done_cv_.notify_one();
+    }
+  }
+}
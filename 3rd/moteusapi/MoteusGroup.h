@@ -0,0 +1,157 @@
+#ifndef MOTEUSGROUP_H__
+#define MOTEUSGROUP_H__
+
+#include <array>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "MoteusTransport.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// Commands any number of moteus controllers, spread over one or more
+// transports, in cycles. A cycle sends the commands of all servos, one
+// batch per transport, and only then collects the replies, so its cost
+// grows with the bytes on the buses rather than with round trips.
+//
+// In cycles with reply, every command is followed by a query, so they
+// also return the state of each servo, and by a read of extra_reads, so
+// registers beyond the query, e.g. PWM, encoder or power values, arrive in
+// the same round trip. Cycles without reply send the bare commands.
+//
+// With bus_threads, every transport is served by its own I/O thread,
+// optionally pinned to a CPU. A cycle releases all threads at once and
+// returns when the last one is done, so the buses run in parallel and the
+// cost of a cycle stays that of the slowest bus as adapters are added.
+//
+// The bus time of every cycle is accounted per bus from the frames the
+// transports moved, and can be estimated ahead from the encoded commands,
+// to check that a control rate fits the bitrate of the buses.
+class MoteusGroup {
+ public:
+  struct Servo {
+    shared_ptr<MoteusTransport> transport;
+    int id = 1;
+  };
+
+  struct Options {
+    // Default time budget of a cycle, sending and replies
+    int64_t cycle_timeout_us = 1000000;
+    mjbots::moteus::PositionResolution position_resolution;
+    mjbots::moteus::QueryCommand query;
+    // Further registers read in every cycle with reply, sorted by register,
+    // each at its resolution
+    vector<mjbots::moteus::RegisterAccess> extra_reads;
+    // One I/O thread per transport
+    bool bus_threads = false;
+    // CPUs the I/O threads are pinned to, in order of the transports and
+    // reused round robin, none if empty
+    vector<int> cpus;
+  };
+
+  MoteusGroup(const vector<Servo>& servos, const Options& options);
+  ~MoteusGroup();
+
+  size_t size() const { return servos_.size(); }
+  int id(size_t i) const { return servos_[i].id; }
+
+  // Commands of servo i for the following cycles
+  void SetPositionCommand(size_t i,
+                          const mjbots::moteus::PositionCommand& command);
+  void SetStopCommand(size_t i);
+
+  // Sends the commands of all servos and, with reply, waits for all
+  // replies, until timeout_us has passed at most (the default budget if
+  // negative). Returns the number of servos that replied, or without
+  // reply whose commands were sent. When the deadline is missed, the rest
+  // of the cycle is abandoned and the transports of the late buses are
+  // resynchronized before the next cycle.
+  size_t Cycle(bool reply = true, int64_t timeout_us = -1);
+
+  // True if the last cycle missed its deadline
+  bool deadline_missed() const { return deadline_missed_; }
+  uint64_t total_deadline_misses() const { return total_deadline_misses_; }
+
+  size_t bus_count() const { return buses_.size(); }
+  // Bus time of the frames of bus b in the last cycle, in microseconds
+  double bus_time_us(size_t b) const { return buses_[b].cycle_time_us; }
+  // Bus time a cycle of the current commands takes on bus b at most, with
+  // reply including the query and its replies
+  double EstimateBusTimeUs(size_t b, bool reply = true) const;
+
+  // Results of the last cycle, indexed like the servos. States of servos
+  // that did not reply are left from an earlier cycle.
+  const mjbots::moteus::QueryState* states() const { return states_.data(); }
+  // True if servo i replied in the last cycle, or for a cycle without
+  // reply if its command was sent
+  bool ok(size_t i) const { return ok_[i] != 0; }
+  // Time from the start of the last cycle until servo i replied, or for a
+  // cycle without reply until its command was sent, the whole cycle if
+  // neither happened
+  int64_t reply_time_us(size_t i) const { return reply_time_us_[i]; }
+  // Values of the extra reads of servo i, in the order of the options, NaN
+  // if missing from its last reply
+  const mjbots::moteus::RegisterAccess* extra_reads(size_t i) const {
+    return extra_.data() + i * options_.extra_reads.size();
+  }
+
+ private:
+  struct Bus {
+    shared_ptr<MoteusTransport> transport;
+    vector<size_t> servos;
+    vector<MoteusFrame> tx;
+    vector<MoteusFrame> rx;
+    // Servo index by moteus ID, -1 if not on this bus
+    array<int, 128> index;
+    size_t missing = 0;
+    size_t completed = 0;
+    // Missed the deadline, late input may follow
+    bool late = false;
+    // Bus time of the transport at the end of the last cycle, and spent
+    // during it
+    double total_time_us = 0;
+    double cycle_time_us = 0;
+  };
+
+  // Throws if the command of servo i leaves no room for the query
+  void CheckCommandSize(size_t i) const;
+  // Sends the commands of a bus
+  void SendBus(Bus& bus, bool reply, int64_t deadline_us);
+  // Collects the replies of a bus until deadline_us
+  void CollectBus(Bus& bus, int64_t deadline_us);
+  void BusThread(size_t b);
+
+  const vector<Servo> servos_;
+  const Options options_;
+  vector<Bus> buses_;
+  // Encoded command of each servo
+  vector<mjbots::moteus::CanFrame> commands_;
+  // Encoded query and extra reads
+  mjbots::moteus::CanFrame query_;
+  vector<mjbots::moteus::QueryState> states_;
+  vector<uint8_t> ok_;
+  vector<int64_t> reply_time_us_;
+  int64_t cycle_start_us_ = 0;
+  vector<mjbots::moteus::RegisterAccess> extra_;
+  // Size of the reply to the query
+  size_t reply_size_ = 0;
+  bool deadline_missed_ = false;
+  uint64_t total_deadline_misses_ = 0;
+
+  // Per-cycle barrier of the I/O threads
+  vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  uint64_t generation_ = 0;
+  size_t running_ = 0;
+  bool cycle_reply_ = false;
+  int64_t cycle_deadline_us_ = 0;
+  bool stopping_ = false;
+};
+
+#endif  // MOTEUSGROUP_H__
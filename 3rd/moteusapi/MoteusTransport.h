@@ -0,0 +1,103 @@
+#ifndef MOTEUSTRANSPORT_H__
+#define MOTEUSTRANSPORT_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "moteus_protocol.h"
+
+// Bitrates of a CAN-FD bus. With bitrate_switch the data phase of frames
+// runs at the data bitrate, otherwise the whole frame at the nominal one.
+struct CanBitrates {
+  int64_t nominal = 1000000;
+  int64_t data = 5000000;
+  bool bitrate_switch = true;
+};
+
+// Length of a CAN-FD frame carrying size bytes, which can only carry 0-8,
+// 12, 16, 20, 24, 32, 48 or 64 bytes
+inline uint8_t CanFdLength(size_t size) {
+  static const uint8_t kLengths[] = {12, 16, 20, 24, 32, 48};
+  if (size <= 8) return size;
+  for (uint8_t length : kLengths) {
+    if (size <= length) return length;
+  }
+  return 64;
+}
+
+// Time on the wire of a CAN-FD frame with an extended ID carrying size
+// bytes, in microseconds. Stuff bits are counted for the worst case, so
+// this is an upper bound.
+inline double CanFdFrameTimeUs(size_t size, const CanBitrates& bitrates) {
+  const int length = CanFdLength(size);
+
+  // SOF to BRS, and CRC delimiter to interframe space
+  const int arbitration_bits = 36;
+  const int tail_bits = 13;
+  // ESI, DLC and data are stuffed dynamically, stuff count and CRC with
+  // fixed stuff bits
+  const int data_bits = 5 + 8 * length;
+  const int crc_bits = length <= 16 ? 4 + 17 + 6 : 4 + 21 + 7;
+
+  const double nominal_bits =
+      arbitration_bits + (arbitration_bits - 1) / 4 + tail_bits;
+  const double fast_bits = data_bits + (data_bits - 1) / 4 + crc_bits;
+
+  return 1e6 * (nominal_bits / bitrates.nominal +
+                fast_bits / (bitrates.bitrate_switch ? bitrates.data
+                                                     : bitrates.nominal));
+}
+
+// A frame to or from a moteus controller. On the bus the arbitration ID
+// is (source << 8) | destination, with 0x8000 set to request a reply.
+// Transports send commands from their own host ID, so source only matters
+// for received frames.
+struct MoteusFrame {
+  uint8_t source = 0;
+  uint8_t destination = 0;
+  bool reply_required = false;
+  mjbots::moteus::CanFrame can;
+};
+
+// Moves raw moteus frames between the host and the controllers of one
+// CAN bus, and accounts the bus time of the frames it sends and receives.
+class MoteusTransport {
+ public:
+  virtual ~MoteusTransport() {}
+
+  const CanBitrates& bitrates() const { return bitrates_; }
+
+  // Bus time of all frames sent and received so far, in microseconds.
+  // Frames between other nodes of the bus are not seen.
+  double bus_time_us() const { return bus_time_us_; }
+
+  // Sends frames in order, batched as far as the transport allows,
+  // waiting up to timeout_us for the transport to accept them. Returns
+  // false if a frame could not be sent in time.
+  virtual bool Send(const MoteusFrame* frames, size_t count,
+                    int64_t timeout_us) = 0;
+
+  // Waits up to timeout_us for frames addressed to the host and stores
+  // up to max_count of them. Returns the number stored, 0 on timeout or
+  // -1 on error.
+  virtual int Receive(MoteusFrame* frames, size_t max_count,
+                      int64_t timeout_us) = 0;
+
+  // Discards input left over from an abandoned exchange, e.g. late
+  // replies, so the next exchange starts clean.
+  virtual void Resync() {}
+
+ protected:
+  explicit MoteusTransport(const CanBitrates& bitrates)
+      : bitrates_(bitrates) {}
+
+  void CountFrame(size_t size) {
+    bus_time_us_ += CanFdFrameTimeUs(size, bitrates_);
+  }
+
+ private:
+  const CanBitrates bitrates_;
+  double bus_time_us_ = 0;
+};
+
+#endif  // MOTEUSTRANSPORT_H__
@@ -0,0 +1,197 @@
+#include "SocketCanTransport.h"
+
+#include <errno.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+SocketCanTransport::SocketCanTransport(const Options& options)
+    : MoteusTransport(options.bitrates),
+      options_(options),
+      tx_frames_(options.max_batch),
+      tx_iov_(options.max_batch),
+      tx_msgs_(options.max_batch),
+      rx_frames_(options.max_batch),
+      rx_iov_(options.max_batch),
+      rx_msgs_(options.max_batch) {
+  fd_ = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd_ < 0) {
+    throw std::runtime_error("SocketCanTransport: Unable to open socket: " +
+                             string(strerror(errno)));
+  }
+
+  int enable = 1;
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable,
+                 sizeof(enable)) < 0) {
+    close(fd_);
+    throw std::runtime_error("SocketCanTransport: CAN-FD not supported");
+  }
+
+  // Only replies to the host: destination is the host ID and the reply
+  // bit is clear, so our own commands on the bus are not received
+  can_filter filter;
+  filter.can_id = options_.host_id;
+  filter.can_mask = 0x80ff;
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FILTER, &filter,
+                 sizeof(filter)) < 0) {
+    close(fd_);
+    throw std::runtime_error("SocketCanTransport: Unable to set CAN filter");
+  }
+
+  ifreq ifr = {};
+  strncpy(ifr.ifr_name, options_.interface.c_str(), IFNAMSIZ - 1);
+  if (ioctl(fd_, SIOCGIFINDEX, &ifr) < 0) {
+    close(fd_);
+    throw std::runtime_error("SocketCanTransport: Unknown interface " +
+                             options_.interface);
+  }
+
+  sockaddr_can address = {};
+  address.can_family = AF_CAN;
+  address.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    close(fd_);
+    throw std::runtime_error("SocketCanTransport: Unable to bind to " +
+                             options_.interface);
+  }
+
+  for (size_t i = 0; i < options_.max_batch; i++) {
+    tx_iov_[i] = {&tx_frames_[i], sizeof(canfd_frame)};
+    tx_msgs_[i] = {};
+    tx_msgs_[i].msg_hdr.msg_iov = &tx_iov_[i];
+    tx_msgs_[i].msg_hdr.msg_iovlen = 1;
+
+    rx_iov_[i] = {&rx_frames_[i], sizeof(canfd_frame)};
+    rx_msgs_[i] = {};
+    rx_msgs_[i].msg_hdr.msg_iov = &rx_iov_[i];
+    rx_msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+SocketCanTransport::~SocketCanTransport() { close(fd_); }
+
+bool SocketCanTransport::Send(const MoteusFrame* frames, size_t count,
+                              int64_t timeout_us) {
+  const int64_t deadline_us = NowUs() + timeout_us;
+
+  while (count > 0) {
+    const size_t batch = std::min(count, options_.max_batch);
+
+    for (size_t i = 0; i < batch; i++) {
+      const MoteusFrame& frame = frames[i];
+      canfd_frame& out = tx_frames_[i];
+
+      out.can_id = CAN_EFF_FLAG | (frame.reply_required ? 0x8000 : 0) |
+                   (options_.host_id << 8) | frame.destination;
+      out.len = CanFdLength(frame.can.size);
+      out.flags = options_.bitrates.bitrate_switch ? CANFD_BRS : 0;
+      std::memcpy(out.data, frame.can.data, frame.can.size);
+      // Pad with no-ops
+      std::memset(&out.data[frame.can.size], mjbots::moteus::Multiplex::kNop,
+                  out.len - frame.can.size);
+    }
+
+    size_t sent = 0;
+    while (sent < batch) {
+      int n = sendmmsg(fd_, &tx_msgs_[sent], batch - sent, 0);
+      if (n > 0) {
+        for (int i = 0; i < n; i++) {
+          CountFrame(tx_frames_[sent + i].len);
+        }
+        sent += n;
+        continue;
+      }
+      // The interface queue is full, wait for it to drain a little
+      if (n < 0 && (errno == ENOBUFS || errno == EAGAIN) &&
+          NowUs() < deadline_us) {
+        pollfd pfd = {fd_, POLLOUT, 0};
+        poll(&pfd, 1, 1);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    frames += batch;
+    count -= batch;
+  }
+  return true;
+}
+
+void SocketCanTransport::Resync() {
+  while (recvmmsg(fd_, rx_msgs_.data(), rx_msgs_.size(), MSG_DONTWAIT,
+                  nullptr) > 0) {
+  }
+}
+
+int SocketCanTransport::Receive(MoteusFrame* frames, size_t max_count,
+                                int64_t timeout_us) {
+  const int64_t deadline_us = NowUs() + timeout_us;
+  const size_t batch = std::min(max_count, options_.max_batch);
+
+  while (true) {
+    int n = recvmmsg(fd_, rx_msgs_.data(), batch, MSG_DONTWAIT, nullptr);
+
+    if (n > 0) {
+      int stored = 0;
+      for (int i = 0; i < n; i++) {
+        const canfd_frame& in = rx_frames_[i];
+        // Classic frames have the same layout up to the data
+        if (rx_msgs_[i].msg_len != CANFD_MTU &&
+            rx_msgs_[i].msg_len != CAN_MTU) {
+          continue;
+        }
+
+        const uint32_t id = in.can_id & CAN_EFF_MASK;
+        MoteusFrame& frame = frames[stored++];
+        frame.source = (id >> 8) & 0x7f;
+        frame.destination = id & 0x7f;
+        frame.reply_required = (id & 0x8000) != 0;
+        frame.can.size = std::min<uint8_t>(in.len, sizeof(frame.can.data));
+        std::memcpy(frame.can.data, in.data, frame.can.size);
+        CountFrame(in.len);
+      }
+      if (stored > 0) {
+        return stored;
+      }
+      continue;
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return -1;
+    }
+
+    const int64_t remaining_us = deadline_us - NowUs();
+    if (remaining_us <= 0) {
+      return 0;
+    }
+
+    pollfd pfd = {fd_, POLLIN, 0};
+    timespec timeout = {static_cast<time_t>(remaining_us / 1000000),
+                        static_cast<long>(remaining_us % 1000000) * 1000};
+    if (ppoll(&pfd, 1, &timeout, nullptr) < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+}
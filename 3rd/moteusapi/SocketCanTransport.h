@@ -0,0 +1,53 @@
+#ifndef SOCKETCANTRANSPORT_H__
+#define SOCKETCANTRANSPORT_H__
+
+#include <linux/can.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <vector>
+
+#include "MoteusTransport.h"
+
+using namespace std;
+
+// Native CAN-FD interface through a SocketCAN CAN_RAW socket. Frames go
+// out as binary CAN-FD frames, a whole batch per sendmmsg, and replies
+// are collected with recvmmsg. Works with the vcan virtual interface:
+//
+//   sudo ip link add dev vcan0 type vcan && sudo ip link set vcan0 mtu 72 up
+class SocketCanTransport : public MoteusTransport {
+ public:
+  struct Options {
+    string interface = "can0";
+    uint8_t host_id = 0;    // source of commands, destination of replies
+    CanBitrates bitrates;   // as configured on the interface
+    size_t max_batch = 64;  // frames per sendmmsg and recvmmsg
+  };
+
+  explicit SocketCanTransport(const Options& options);
+  ~SocketCanTransport();
+
+  bool Send(const MoteusFrame* frames, size_t count,
+            int64_t timeout_us) override;
+  int Receive(MoteusFrame* frames, size_t max_count,
+              int64_t timeout_us) override;
+  void Resync() override;
+
+  int FileDescriptor() const { return fd_; }
+
+ private:
+  const Options options_;
+  int fd_;
+
+  // Preallocated batches, so a cycle does not allocate
+  vector<canfd_frame> tx_frames_;
+  vector<iovec> tx_iov_;
+  vector<mmsghdr> tx_msgs_;
+  vector<canfd_frame> rx_frames_;
+  vector<iovec> rx_iov_;
+  vector<mmsghdr> rx_msgs_;
+};
+
+#endif  // SOCKETCANTRANSPORT_H__
@@ -14,12 +14,18 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <initializer_list>
 #include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
 
 /// @file
 ///
@@ -128,6 +134,72 @@ enum Register : uint32_t {
   kRezero = 0x130,
 };
 
+/// The scales of a register's int8, int16 and int32 encodings, as used
+/// by the Read* and Write* helpers.
+struct RegisterScale {
+  double int8;
+  double int16;
+  double int32;
+};
+
+constexpr RegisterScale GetRegisterScale(uint32_t reg) {
+  switch (reg) {
+    case Register::kPosition:
+    case Register::kAbsPosition:
+    case Register::kCommandPosition:
+    case Register::kCommandStopPosition:
+    case Register::kStayWithinLower:
+    case Register::kStayWithinUpper:
+      return {0.01, 0.0001, 0.00001};
+    case Register::kVelocity:
+    case Register::kCommandVelocity:
+      return {0.1, 0.00025, 0.00001};
+    case Register::kTorque:
+    case Register::kCommandFeedforwardTorque:
+    case Register::kCommandPositionMaxTorque:
+    case Register::kPositionKp:
+    case Register::kPositionKi:
+    case Register::kPositionKd:
+    case Register::kPositionFeedforward:
+    case Register::kPositionCommandTorque:
+    case Register::kStayWithinFeedforward:
+    case Register::kStayWithinMaxTorque:
+      return {0.5, 0.01, 0.001};
+    case Register::kQCurrent:
+    case Register::kDCurrent:
+    case Register::kCommandQCurrent:
+    case Register::kCommandDCurrent:
+      return {1.0, 0.1, 0.001};
+    case Register::kVoltage:
+    case Register::kVoltagePhaseA:
+    case Register::kVoltagePhaseB:
+    case Register::kVoltagePhaseC:
+    case Register::kVFocVoltage:
+    case Register::kVoltageDqD:
+    case Register::kVoltageDqQ:
+      return {0.5, 0.1, 0.001};
+    case Register::kTemperature:
+      return {1.0, 0.1, 0.001};
+    case Register::kPwmPhaseA:
+    case Register::kPwmPhaseB:
+    case Register::kPwmPhaseC:
+    case Register::kCommandKpScale:
+    case Register::kCommandKdScale:
+    case Register::kStayWithinKpScale:
+    case Register::kStayWithinKdScale:
+      return {1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0};
+    case Register::kVFocTheta:
+      return {M_PI / 127.0, M_PI / 32767.0, M_PI / 2147483647.0};
+    case Register::kCommandTimeout:
+    case Register::kStayWithinTimeout:
+      return {0.01, 0.001, 0.000001};
+    default:
+      // Modes, faults, flags and identification registers are plain
+      // integers.
+      return {1.0, 1.0, 1.0};
+  }
+}
+
 enum class Mode {
   kStopped = 0,
   kFault = 1,
@@ -255,6 +327,12 @@ class WriteCanFrame {
     WriteMapped(value, 0.01, 0.001, 0.000001, res);
   }
 
+  /// Writes value with the scale of register reg.
+  void WriteRegister(uint32_t reg, double value, Resolution res) {
+    const RegisterScale scale = GetRegisterScale(reg);
+    WriteMapped(value, scale.int8, scale.int16, scale.int32, res);
+  }
+
  private:
   uint8_t *const data_;
   uint8_t *const size_;
@@ -274,7 +352,9 @@ class WriteCombiner {
         resolutions_(resolutions) {}
 
   ~WriteCombiner() {
-    if (offset_ != N) {
+    // An overflowing frame may leave registers unwritten; let the
+    // exception reach the caller, who discards the frame.
+    if (offset_ != N && !std::uncaught_exceptions()) {
       ::abort();
     }
   }
@@ -350,7 +430,9 @@ class MultiplexParser {
  public:
   MultiplexParser(const CanFrame *frame)
       : data_(&frame->data[0]), size_(frame->size) {}
-  MultiplexParser(const uint8_t *data, uint8_t size)
+  // size is not narrowed to the 64 bytes of a CAN frame, so longer
+  // buffers are bounded by their real size.
+  MultiplexParser(const uint8_t *data, size_t size)
       : data_(data), size_(size) {}
 
   std::tuple<bool, uint32_t, Resolution> next() {
@@ -512,6 +594,12 @@ class MultiplexParser {
     return ReadMapped(res, 1.0, 0.1, 0.001);
   }
 
+  /// Reads a value with the scale of register reg.
+  double ReadRegister(uint32_t reg, Resolution res) {
+    const RegisterScale scale = GetRegisterScale(reg);
+    return ReadMapped(res, scale.int8, scale.int16, scale.int32);
+  }
+
   void Ignore(Resolution res) { offset_ += ResolutionSize(res); }
 
  private:
@@ -533,7 +621,7 @@ class MultiplexParser {
   }
 
   const uint8_t *const data_;
-  const uint8_t size_;
+  const size_t size_;
   size_t offset_ = 0;
 
   int remaining_ = 0;
@@ -738,6 +826,96 @@ inline void EmitQueryCommand(WriteCanFrame *frame,
   }
 }
 
+/// A register to write or read in a batch, at the given resolution.
+struct RegisterAccess {
+  Register reg = Register::kMode;
+  Resolution resolution = Resolution::kFloat;
+  // The value to write, or the value read from the reply.
+  double value = std::numeric_limits<double>::quiet_NaN();
+};
+
+namespace detail {
+
+// Emits accesses sorted by register in windows of up to 16 registers,
+// framed by WriteCombiner. Registers of a window that are not accessed
+// are skipped.
+inline void EmitRegisterAccesses(WriteCanFrame *frame, int8_t base_command,
+                                 const RegisterAccess *accesses, size_t count,
+                                 bool write_values) {
+  constexpr size_t kWindow = 16;
+
+  size_t i = 0;
+  while (i < count) {
+    const uint32_t start_register = accesses[i].reg;
+    std::array<Resolution, kWindow> resolutions;
+    resolutions.fill(Resolution::kIgnore);
+    std::array<double, kWindow> values = {};
+
+    for (; i < count && accesses[i].reg < start_register + kWindow; i++) {
+      if (i > 0 && accesses[i].reg <= accesses[i - 1].reg) {
+        throw std::logic_error("registers must be sorted and unique");
+      }
+      resolutions[accesses[i].reg - start_register] = accesses[i].resolution;
+      values[accesses[i].reg - start_register] = accesses[i].value;
+    }
+
+    WriteCombiner<kWindow> combiner(frame, base_command, start_register,
+                                    resolutions);
+    for (size_t k = 0; k < kWindow; k++) {
+      if (combiner.MaybeWrite() && write_values) {
+        frame->WriteRegister(start_register + k, values[k], resolutions[k]);
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
+/// Emits writes of arbitrary registers, sorted by register, each at its
+/// resolution. Only registers up to 127 are supported, and the frame
+/// must fit into 64 bytes, otherwise an exception is thrown.
+inline void EmitWriteRegisters(WriteCanFrame *frame,
+                               const RegisterAccess *accesses, size_t count) {
+  detail::EmitRegisterAccesses(frame, Multiplex::kWriteBase, accesses, count,
+                               true);
+}
+
+/// Emits reads of arbitrary registers, sorted by register, each replied
+/// at its resolution. The same limits as for EmitWriteRegisters apply.
+inline void EmitReadRegisters(WriteCanFrame *frame,
+                              const RegisterAccess *accesses, size_t count) {
+  detail::EmitRegisterAccesses(frame, Multiplex::kReadBase, accesses, count,
+                               false);
+}
+
+/// Stores the values of a reply into the accesses, sorted by register.
+/// Registers missing from the reply are set to NaN.
+inline void ParseRegisterReply(const uint8_t *data, size_t size,
+                               RegisterAccess *accesses, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    accesses[i].value = std::numeric_limits<double>::quiet_NaN();
+  }
+
+  MultiplexParser parser(data, size);
+  while (true) {
+    auto entry = parser.next();
+    if (!std::get<0>(entry)) {
+      break;
+    }
+    const auto reg = std::get<1>(entry);
+    const auto res = std::get<2>(entry);
+
+    RegisterAccess *access = std::lower_bound(
+        accesses, accesses + count, reg,
+        [](const RegisterAccess &a, uint32_t r) { return a.reg < r; });
+    if (access != accesses + count && access->reg == reg) {
+      access->value = parser.ReadRegister(reg, res);
+    } else {
+      parser.Ignore(res);
+    }
+  }
+}
+
 struct QueryResult {
   Mode mode = Mode::kStopped;
   double position = std::numeric_limits<double>::quiet_NaN();
@@ -811,5 +989,191 @@ inline QueryResult ParseQueryResult(const uint8_t *data, size_t size) {
   return result;
 }
 
+/// Converts a raw reply value of register R to its unit, NaN for the
+/// reserved minimum of the integer encodings.
+template <Register R, typename T>
+double DecodeRegister(T raw) {
+  if constexpr (std::is_floating_point<T>::value) {
+    return raw;
+  } else {
+    if (raw == std::numeric_limits<T>::min()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    constexpr RegisterScale kScale = GetRegisterScale(R);
+    constexpr double kFactor = sizeof(T) == 1   ? kScale.int8
+                               : sizeof(T) == 2 ? kScale.int16
+                                                : kScale.int32;
+    return raw * kFactor;
+  }
+}
+
+/// A set of registers to decode with ParseRegisters, fixed at compile
+/// time.
+template <Register... Registers>
+struct RegisterList {
+  static_assert(sizeof...(Registers) > 0, "empty register list");
+
+  static constexpr uint32_t kMin = std::min({Registers...});
+  static constexpr uint32_t kMax = std::max({Registers...});
+
+  /// Calls visitor for reg if it is in the list. Returns false if not.
+  template <typename T, typename Visitor>
+  static bool Visit(uint32_t reg, T raw, Visitor &visitor) {
+    return ((reg == Registers &&
+             (visitor(std::integral_constant<Register, Registers>(),
+                      DecodeRegister<Registers>(raw)),
+              true)) ||
+            ...);
+  }
+};
+
+namespace detail {
+
+inline int ToInt(double value) {
+  return std::isfinite(value) ? static_cast<int>(value) : 0;
+}
+
+template <typename List, typename T, typename Visitor>
+void VisitReplyBlock(const uint8_t *data, uint32_t start_register,
+                     size_t count, Visitor &visitor) {
+  for (size_t i = 0; i < count; i++) {
+    T raw;
+    std::memcpy(&raw, &data[i * sizeof(T)], sizeof(T));
+    List::Visit(start_register + i, raw, visitor);
+  }
+}
+
+}  // namespace detail
+
+/// Parses a reply frame, calling visitor(std::integral_constant<Register,
+/// R>(), value) for every register R of List it contains, with the value
+/// converted as by the Read* helpers. Other registers are skipped without
+/// decoding, whole blocks at once when none of their registers is in
+/// List.
+///
+/// Returns false if the frame is truncated or contains something other
+/// than replies, after visiting the registers before that point.
+template <typename List, typename Visitor>
+bool ParseRegisters(const uint8_t *data, size_t size, Visitor &&visitor) {
+  size_t offset = 0;
+
+  while (offset < size) {
+    const uint8_t cmd = data[offset++];
+    if (cmd == Multiplex::kNop) {
+      continue;
+    }
+    if (cmd < Multiplex::kReplyBase || cmd >= Multiplex::kWriteError) {
+      return false;
+    }
+
+    size_t count = cmd & 0x03;
+    if (count == 0) {
+      if (offset >= size) {
+        return false;
+      }
+      count = data[offset++];
+      if (count == 0) {
+        continue;
+      }
+    }
+    if (offset >= size) {
+      return false;
+    }
+    const uint32_t start_register = data[offset++];
+
+    // Value sizes as shifts, in the order of the reply commands.
+    static constexpr uint8_t kSizeShifts[] = {0, 1, 2, 2};
+    const size_t resolution = (cmd >> 2) & 0x03;
+    const size_t value_size = size_t{1} << kSizeShifts[resolution];
+
+    bool truncated = false;
+    if (count * value_size > size - offset) {
+      count = (size - offset) >> kSizeShifts[resolution];
+      truncated = true;
+    }
+
+    if (start_register <= List::kMax &&
+        start_register + count > List::kMin) {
+      switch (resolution) {
+        case 0:
+          detail::VisitReplyBlock<List, int8_t>(&data[offset], start_register,
+                                                count, visitor);
+          break;
+        case 1:
+          detail::VisitReplyBlock<List, int16_t>(
+              &data[offset], start_register, count, visitor);
+          break;
+        case 2:
+          detail::VisitReplyBlock<List, int32_t>(
+              &data[offset], start_register, count, visitor);
+          break;
+        case 3:
+          detail::VisitReplyBlock<List, float>(&data[offset], start_register,
+                                               count, visitor);
+          break;
+      }
+    }
+    offset += count * value_size;
+
+    if (truncated) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// The registers requested by the default QueryCommand.
+using QueryRegisters =
+    RegisterList<Register::kMode, Register::kPosition, Register::kVelocity,
+                 Register::kTorque, Register::kQCurrent, Register::kDCurrent,
+                 Register::kRezeroState, Register::kVoltage,
+                 Register::kTemperature, Register::kFault>;
+
+/// Compact form of QueryResult, filled by ParseQueryState.
+struct QueryState {
+  float position = std::numeric_limits<float>::quiet_NaN();
+  float velocity = std::numeric_limits<float>::quiet_NaN();
+  float torque = std::numeric_limits<float>::quiet_NaN();
+  float q_current = std::numeric_limits<float>::quiet_NaN();
+  float d_current = std::numeric_limits<float>::quiet_NaN();
+  float voltage = std::numeric_limits<float>::quiet_NaN();
+  float temperature = std::numeric_limits<float>::quiet_NaN();
+  int16_t fault = 0;
+  int8_t mode = static_cast<int8_t>(Mode::kStopped);
+  bool rezero_state = false;
+};
+
+/// Same result as ParseQueryResult, decoded with ParseRegisters.
+inline QueryState ParseQueryState(const uint8_t *data, size_t size) {
+  QueryState state;
+  ParseRegisters<QueryRegisters>(data, size, [&state](auto reg,
+                                                      double value) {
+    constexpr Register kRegister = decltype(reg)::value;
+
+    if constexpr (kRegister == Register::kMode) {
+      state.mode = static_cast<int8_t>(detail::ToInt(value));
+    } else if constexpr (kRegister == Register::kPosition) {
+      state.position = value;
+    } else if constexpr (kRegister == Register::kVelocity) {
+      state.velocity = value;
+    } else if constexpr (kRegister == Register::kTorque) {
+      state.torque = value;
+    } else if constexpr (kRegister == Register::kQCurrent) {
+      state.q_current = value;
+    } else if constexpr (kRegister == Register::kDCurrent) {
+      state.d_current = value;
+    } else if constexpr (kRegister == Register::kRezeroState) {
+      state.rezero_state = detail::ToInt(value) != 0;
+    } else if constexpr (kRegister == Register::kVoltage) {
+      state.voltage = value;
+    } else if constexpr (kRegister == Register::kTemperature) {
+      state.temperature = value;
+    } else if constexpr (kRegister == Register::kFault) {
+      state.fault = static_cast<int16_t>(detail::ToInt(value));
+    }
+  });
+  return state;
+}
+
 }  // namespace moteus
 }  // namespace mjbots
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+// Wire format of the speed commands sent from the publisher to the
+// subscriber.
+//
+// Legacy frame (12 bytes):
+//
+//   float x-axis speed | float y-axis speed | float rotation speed
+//
+// Versioned frame (16 byte header + 12 or 6 byte payload):
+//
+//   uint8 magic | uint8 version | uint8 flags | uint8 reserved
+//   uint32 sequence number
+//   uint64 sender monotonic timestamp (us)
+//   payload: 3 x float, or 3 x int16 when FLAG_FIXED_POINT is set
+//
+// All fields are little endian.
+
+namespace rc
+{
+
+constexpr uint8_t FRAME_MAGIC = 0xa5;
+constexpr uint8_t FRAME_VERSION = 1;
+
+// Payload is encoded as int16 fixed point instead of float
+constexpr uint8_t FLAG_FIXED_POINT = 0x01;
+// First frame of a new publisher session, resets sequence tracking
+constexpr uint8_t FLAG_SESSION_START = 0x02;
+
+constexpr size_t LEGACY_FRAME_SIZE = 12;
+constexpr size_t FRAME_HEADER_SIZE = 16;
+constexpr size_t FLOAT_FRAME_SIZE = FRAME_HEADER_SIZE + 3 * sizeof(float);
+constexpr size_t FIXED_FRAME_SIZE = FRAME_HEADER_SIZE + 3 * sizeof(int16_t);
+constexpr size_t MAX_FRAME_SIZE = FLOAT_FRAME_SIZE;
+
+// Fixed point resolution: 1 mm/s or 1 mrad/s, range +-32.767
+constexpr float FIXED_POINT_SCALE = 0.001f;
+
+enum class FrameFormat
+{
+    LEGACY,
+    FLOAT,
+    FIXED,
+};
+
+struct Command
+{
+    float move_x = 0.0f;
+    float move_y = 0.0f;
+    float turn = 0.0f;
+};
+
+struct FrameHeader
+{
+    uint8_t version = 0; // 0 for legacy frames
+    uint8_t flags = 0;
+    uint32_t sequence = 0;
+    uint64_t timestamp_us = 0;
+};
+
+// Monotonic timestamp used in the frame header
+inline uint64_t monotonic_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline size_t frame_size(FrameFormat format)
+{
+    switch (format)
+    {
+    case FrameFormat::LEGACY:
+        return LEGACY_FRAME_SIZE;
+    case FrameFormat::FLOAT:
+        return FLOAT_FRAME_SIZE;
+    case FrameFormat::FIXED:
+        return FIXED_FRAME_SIZE;
+    }
+    return 0;
+}
+
+inline int16_t to_fixed_point(float value)
+{
+    if (!std::isfinite(value))
+    {
+        return 0;
+    }
+
+    float scaled = std::round(value / FIXED_POINT_SCALE);
+    if (scaled > 32767.0f)
+    {
+        return 32767;
+    }
+    if (scaled < -32767.0f)
+    {
+        return -32767;
+    }
+    return static_cast<int16_t>(scaled);
+}
+
+// Encodes command into out, which must hold at least frame_size(format)
+// bytes. Returns the number of bytes written.
+inline size_t encode_frame(uint8_t *out, const Command &command, FrameFormat format, uint32_t sequence, uint64_t timestamp_us, uint8_t flags = 0)
+{
+    if (format == FrameFormat::LEGACY)
+    {
+        memcpy(out, &command.move_x, 4);
+        memcpy(out + 4, &command.move_y, 4);
+        memcpy(out + 8, &command.turn, 4);
+        return LEGACY_FRAME_SIZE;
+    }
+
+    if (format == FrameFormat::FIXED)
+    {
+        flags |= FLAG_FIXED_POINT;
+    }
+    else
+    {
+        flags &= ~FLAG_FIXED_POINT;
+    }
+
+    out[0] = FRAME_MAGIC;
+    out[1] = FRAME_VERSION;
+    out[2] = flags;
+    out[3] = 0;
+    memcpy(out + 4, &sequence, 4);
+    memcpy(out + 8, &timestamp_us, 8);
+
+    uint8_t *payload = out + FRAME_HEADER_SIZE;
+
+    if (format == FrameFormat::FIXED)
+    {
+        int16_t values[3] = {to_fixed_point(command.move_x), to_fixed_point(command.move_y), to_fixed_point(command.turn)};
+        memcpy(payload, values, sizeof(values));
+        return FIXED_FRAME_SIZE;
+    }
+
+    memcpy(payload, &command.move_x, 4);
+    memcpy(payload + 4, &command.move_y, 4);
+    memcpy(payload + 8, &command.turn, 4);
+    return FLOAT_FRAME_SIZE;
+}
+
+// Decodes a legacy or versioned frame. Returns false if the length, magic
+// or version do not match a known format.
+inline bool decode_frame(const uint8_t *data, size_t len, Command *command, FrameHeader *header)
+{
+    if (len == LEGACY_FRAME_SIZE)
+    {
+        memcpy(&command->move_x, data, 4);
+        memcpy(&command->move_y, data + 4, 4);
+        memcpy(&command->turn, data + 8, 4);
+        *header = FrameHeader();
+        return true;
+    }
+
+    if (len < FRAME_HEADER_SIZE || data[0] != FRAME_MAGIC || data[1] != FRAME_VERSION)
+    {
+        return false;
+    }
+
+    FrameHeader h;
+    h.version = data[1];
+    h.flags = data[2];
+    memcpy(&h.sequence, data + 4, 4);
+    memcpy(&h.timestamp_us, data + 8, 8);
+
+    const uint8_t *payload = data + FRAME_HEADER_SIZE;
+
+    if (h.flags & FLAG_FIXED_POINT)
+    {
+        if (len != FIXED_FRAME_SIZE)
+        {
+            return false;
+        }
+
+        int16_t values[3];
+        memcpy(values, payload, sizeof(values));
+        command->move_x = values[0] * FIXED_POINT_SCALE;
+        command->move_y = values[1] * FIXED_POINT_SCALE;
+        command->turn = values[2] * FIXED_POINT_SCALE;
+    }
+    else
+    {
+        if (len != FLOAT_FRAME_SIZE)
+        {
+            return false;
+        }
+
+        memcpy(&command->move_x, payload, 4);
+        memcpy(&command->move_y, payload + 4, 4);
+        memcpy(&command->turn, payload + 8, 4);
+    }
+
+    *header = h;
+    return true;
+}
+
+// Drops out-of-order and stale versioned frames on the receiving side.
+//
+// Sender and receiver clocks are not synchronized, so staleness is judged
+// relative to the smallest transit offset (receive time - send time) seen
+// recently. A frame that arrives more than max_age_us later than the best
+// observed transit is considered stale.
+//
+// The two clocks also drift apart: if the sender's clock runs slow, the
+// offset grows steadily and a minimum kept forever would eventually make
+// every frame stale. The reference is therefore the minimum offset of the
+// last OFFSET_WINDOWS windows of OFFSET_WINDOW_US, and it rises no faster
+// than MAX_CLOCK_DRIFT_PPM. It only rises when the observed minimum does,
+// following real drift with a lag of its rate times the windows' span,
+// 8 ms at 1000 ppm; a burst of delayed frames raises it only by the
+// drift allowance over the burst.
+constexpr int64_t MAX_CLOCK_DRIFT_PPM = 1000;
+constexpr uint64_t OFFSET_WINDOW_US = 1000000;
+constexpr size_t OFFSET_WINDOWS = 8;
+
+class FrameFilter
+{
+public:
+    enum Verdict
+    {
+        ACCEPT,
+        OUT_OF_ORDER,
+        STALE,
+    };
+
+    // reset_after_us: forget the sequence state if no frame was accepted
+    // for this long (e.g. the publisher was restarted)
+    FrameFilter(uint64_t max_age_us, uint64_t reset_after_us)
+        : max_age_us_(max_age_us), reset_after_us_(reset_after_us)
+    {
+    }
+
+    Verdict check(const FrameHeader &header, uint64_t now_us)
+    {
+        // Legacy frames carry no header, accept them as is
+        if (header.version == 0)
+        {
+            return ACCEPT;
+        }
+
+        bool restart = !synced_ || (header.flags & FLAG_SESSION_START) || now_us - last_accept_us_ > reset_after_us_;
+
+        if (!restart && static_cast<int32_t>(header.sequence - last_sequence_) <= 0)
+        {
+            return OUT_OF_ORDER;
+        }
+
+        int64_t offset = static_cast<int64_t>(now_us - header.timestamp_us);
+
+        if (restart)
+        {
+            std::fill(std::begin(window_min_), std::end(window_min_), offset);
+            window_start_us_ = now_us;
+        }
+
+        // Start a window per OFFSET_WINDOW_US, the oldest one is dropped
+        for (size_t i = 0; i < OFFSET_WINDOWS && now_us - window_start_us_ >= OFFSET_WINDOW_US; i++)
+        {
+            window_ = (window_ + 1) % OFFSET_WINDOWS;
+            window_min_[window_] = INT64_MAX;
+            window_start_us_ += OFFSET_WINDOW_US;
+        }
+        if (now_us - window_start_us_ >= OFFSET_WINDOW_US)
+        {
+            // All windows passed without a frame
+            window_start_us_ = now_us;
+        }
+
+        // The observed minimum, rising no faster than the drift allowance.
+        // No reference after OFFSET_WINDOWS without an accepted frame.
+        int64_t observed = *std::min_element(std::begin(window_min_), std::end(window_min_));
+        int64_t reference = reference_ + static_cast<int64_t>(now_us - reference_us_) * MAX_CLOCK_DRIFT_PPM / 1000000;
+        if (restart || observed < reference)
+        {
+            reference = reference_ = observed;
+            reference_us_ = now_us;
+        }
+
+        if (max_age_us_ > 0 && observed != INT64_MAX && offset - reference > static_cast<int64_t>(max_age_us_))
+        {
+            // Still advance the sequence so older frames behind it get dropped
+            last_sequence_ = header.sequence;
+            return STALE;
+        }
+
+        window_min_[window_] = std::min(window_min_[window_], offset);
+        synced_ = true;
+        last_sequence_ = header.sequence;
+        last_accept_us_ = now_us;
+        return ACCEPT;
+    }
+
+private:
+    const uint64_t max_age_us_;
+    const uint64_t reset_after_us_;
+    bool synced_ = false;
+    uint32_t last_sequence_ = 0;
+    uint64_t last_accept_us_ = 0;
+    // Smallest offset of accepted frames per window, INT64_MAX if none
+    int64_t window_min_[OFFSET_WINDOWS] = {};
+    size_t window_ = 0;
+    uint64_t window_start_us_ = 0; // receive time the current window began
+    // Reference offset when it last followed the observed minimum
+    int64_t reference_ = 0;
+    uint64_t reference_us_ = 0;
+};
+
+// The subscriber can echo every received command message for delivery
+// measurements: the echo is the received payload followed by one status
+// byte.
+enum EchoStatus : uint8_t
+{
+    ECHO_ACCEPTED = 0,
+    ECHO_MALFORMED = 1,
+    ECHO_OUT_OF_ORDER = 2,
+    ECHO_STALE = 3,
+};
+
+} // namespace rc
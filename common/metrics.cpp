@@ -0,0 +1,239 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace metrics
+{
+
+static void render_header(std::string *out, const std::string &name, const std::string &help, const char *type)
+{
+    *out += "# HELP " + name + " " + help + "\n";
+    *out += "# TYPE " + name + " " + type + "\n";
+}
+
+static std::string format_number(double value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+
+void Counter::render(std::string *out) const
+{
+    render_header(out, name_, help_, "counter");
+    *out += name_ + " " + std::to_string(value()) + "\n";
+}
+
+void Gauge::render(std::string *out) const
+{
+    render_header(out, name_, help_, "gauge");
+    *out += name_ + " " + format_number(value()) + "\n";
+}
+
+Histogram::Histogram(std::string name, std::string help, std::vector<uint64_t> bounds, double scale)
+    : name_(std::move(name)), help_(std::move(help)), bounds_(std::move(bounds)), scale_(scale), buckets_(bounds_.size() + 1)
+{
+}
+
+uint64_t Histogram::quantile(double q) const
+{
+    uint64_t total = count();
+    if (total == 0 || bounds_.empty())
+    {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * total));
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds_.size(); i++)
+    {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        if (cumulative >= rank)
+        {
+            return bounds_[i];
+        }
+    }
+    return bounds_.back();
+}
+
+void Histogram::render(std::string *out) const
+{
+    render_header(out, name_, help_, "histogram");
+
+    // Buckets are read one by one, so a concurrent observe may make the
+    // total slightly inconsistent with the buckets, which Prometheus
+    // tolerates
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds_.size(); i++)
+    {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        *out += name_ + "_bucket{le=\"" + format_number(bounds_[i] * scale_) + "\"} " + std::to_string(cumulative) + "\n";
+    }
+    cumulative += buckets_[bounds_.size()].load(std::memory_order_relaxed);
+    *out += name_ + "_bucket{le=\"+Inf\"} " + std::to_string(cumulative) + "\n";
+    *out += name_ + "_sum " + format_number(sum_.load(std::memory_order_relaxed) * scale_) + "\n";
+    *out += name_ + "_count " + std::to_string(cumulative) + "\n";
+}
+
+std::vector<uint64_t> exponential_buckets(uint64_t start, double factor, size_t count)
+{
+    std::vector<uint64_t> bounds;
+    double bound = start;
+    for (size_t i = 0; i < count; i++)
+    {
+        bounds.push_back(static_cast<uint64_t>(bound));
+        bound *= factor;
+    }
+    return bounds;
+}
+
+Counter &Registry::counter(const std::string &name, const std::string &help)
+{
+    return counters_.emplace_back(name, help);
+}
+
+Gauge &Registry::gauge(const std::string &name, const std::string &help)
+{
+    return gauges_.emplace_back(name, help);
+}
+
+Histogram &Registry::histogram(const std::string &name, const std::string &help, std::vector<uint64_t> bounds, double scale)
+{
+    return histograms_.emplace_back(name, help, std::move(bounds), scale);
+}
+
+std::string Registry::render() const
+{
+    std::string out;
+    for (const auto &counter : counters_)
+    {
+        counter.render(&out);
+    }
+    for (const auto &gauge : gauges_)
+    {
+        gauge.render(&out);
+    }
+    for (const auto &histogram : histograms_)
+    {
+        histogram.render(&out);
+    }
+    return out;
+}
+
+HttpServer::~HttpServer()
+{
+    stop();
+}
+
+bool HttpServer::start(const std::string &address, uint16_t port)
+{
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+    {
+        perror("HttpServer: socket");
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "HttpServer: invalid address %s\n", address.c_str());
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    if (bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd_, 4) != 0)
+    {
+        perror("HttpServer: bind");
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    running_ = true;
+    thread_ = std::thread(&HttpServer::serve, this);
+    return true;
+}
+
+void HttpServer::stop()
+{
+    running_ = false;
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+void HttpServer::serve()
+{
+    while (running_)
+    {
+        // Wake up regularly to notice stop()
+        pollfd pfd = {fd_, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0)
+        {
+            continue;
+        }
+
+        int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            continue;
+        }
+
+        // Don't let a slow client hold the thread
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char request[1024];
+        ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+        request[n > 0 ? n : 0] = 0;
+
+        std::string response;
+        if (strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0)
+        {
+            std::string body = registry_.render();
+            response = "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: " +
+                       std::to_string(body.size()) + "\r\n\r\n" + body;
+        }
+        else
+        {
+            response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        }
+
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t w = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (w <= 0)
+            {
+                break;
+            }
+            sent += w;
+        }
+        close(client);
+    }
+}
+
+} // namespace metrics
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lock-free counters, gauges and histograms exposed in Prometheus text
+// format. Metrics are registered once at startup; updating them afterwards
+// is a relaxed atomic operation and never blocks the control path.
+
+namespace metrics
+{
+
+class Counter
+{
+public:
+    Counter(std::string name, std::string help) : name_(std::move(name)), help_(std::move(help)) {}
+
+    void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+    void render(std::string *out) const;
+
+private:
+    const std::string name_;
+    const std::string help_;
+    std::atomic<uint64_t> value_{0};
+};
+
+class Gauge
+{
+public:
+    Gauge(std::string name, std::string help) : name_(std::move(name)), help_(std::move(help)) {}
+
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+    void render(std::string *out) const;
+
+private:
+    const std::string name_;
+    const std::string help_;
+    std::atomic<double> value_{0.0};
+};
+
+// Histogram of integer observations (e.g. microseconds). Bucket bounds are
+// given in the same unit and multiplied by scale when rendered (e.g. 1e-6
+// to export seconds).
+class Histogram
+{
+public:
+    Histogram(std::string name, std::string help, std::vector<uint64_t> bounds, double scale);
+
+    void observe(uint64_t value)
+    {
+        size_t i = 0;
+        while (i < bounds_.size() && value > bounds_[i])
+        {
+            i++;
+        }
+        buckets_[i].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket containing quantile q (0..1), in the
+    // observation unit. Returns the largest bound for the overflow bucket.
+    uint64_t quantile(double q) const;
+
+    void render(std::string *out) const;
+
+private:
+    const std::string name_;
+    const std::string help_;
+    const std::vector<uint64_t> bounds_;
+    const double scale_;
+    std::deque<std::atomic<uint64_t>> buckets_; // bounds + overflow
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> count_{0};
+};
+
+// Exponential bucket bounds: start, start * factor, ... (count bounds)
+std::vector<uint64_t> exponential_buckets(uint64_t start, double factor, size_t count);
+
+class Registry
+{
+public:
+    // Returned references stay valid for the lifetime of the registry
+    Counter &counter(const std::string &name, const std::string &help);
+    Gauge &gauge(const std::string &name, const std::string &help);
+    Histogram &histogram(const std::string &name, const std::string &help, std::vector<uint64_t> bounds, double scale = 1e-6);
+
+    std::string render() const;
+
+private:
+    std::deque<Counter> counters_;
+    std::deque<Gauge> gauges_;
+    std::deque<Histogram> histograms_;
+};
+
+// Minimal HTTP server answering GET /metrics on a background thread
+class HttpServer
+{
+public:
+    explicit HttpServer(const Registry &registry) : registry_(registry) {}
+    HttpServer(HttpServer const &) = delete;
+    ~HttpServer();
+
+    bool start(const std::string &address, uint16_t port);
+    void stop();
+
+private:
+    void serve();
+
+    const Registry &registry_;
+    int fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+};
+
+} // namespace metrics
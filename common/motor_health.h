@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Motor health message published by the subscriber and returned by its
+// health queryable:
+//
+//   uint8 magic | uint8 version | uint8 motor count | uint8 reserved
+//   uint32 sequence number
+//   uint64 subscriber monotonic timestamp (us) of the sample
+//   motor count x MotorHealth (12 bytes each)
+//
+// All fields are little endian.
+
+namespace rc
+{
+
+constexpr uint8_t HEALTH_MAGIC = 0x4d;
+constexpr uint8_t HEALTH_VERSION = 1;
+constexpr size_t HEALTH_HEADER_SIZE = 16;
+
+// MotorHealth::flags
+constexpr uint8_t HEALTH_VALID = 0x01; // motor replied to the last query
+
+struct MotorHealth
+{
+    uint8_t id = 0;
+    uint8_t flags = 0;
+    uint8_t mode = 0;
+    uint8_t fault = 0;
+    float voltage = NAN;     // V
+    float temperature = NAN; // C
+};
+
+static_assert(sizeof(MotorHealth) == 12, "MotorHealth layout changed");
+
+inline void encode_health(std::vector<uint8_t> *out, const std::vector<MotorHealth> &motors, uint32_t sequence, uint64_t timestamp_us)
+{
+    out->resize(HEALTH_HEADER_SIZE + motors.size() * sizeof(MotorHealth));
+    uint8_t *data = out->data();
+    data[0] = HEALTH_MAGIC;
+    data[1] = HEALTH_VERSION;
+    data[2] = static_cast<uint8_t>(motors.size());
+    data[3] = 0;
+    memcpy(data + 4, &sequence, 4);
+    memcpy(data + 8, &timestamp_us, 8);
+    if (!motors.empty())
+    {
+        memcpy(data + HEALTH_HEADER_SIZE, motors.data(), motors.size() * sizeof(MotorHealth));
+    }
+}
+
+inline bool decode_health(const uint8_t *data, size_t len, std::vector<MotorHealth> *motors, uint32_t *sequence, uint64_t *timestamp_us)
+{
+    if (len < HEALTH_HEADER_SIZE || data[0] != HEALTH_MAGIC || data[1] != HEALTH_VERSION ||
+        len != HEALTH_HEADER_SIZE + data[2] * sizeof(MotorHealth))
+    {
+        return false;
+    }
+
+    memcpy(sequence, data + 4, 4);
+    memcpy(timestamp_us, data + 8, 8);
+    motors->resize(data[2]);
+    if (!motors->empty())
+    {
+        memcpy(motors->data(), data + HEALTH_HEADER_SIZE, motors->size() * sizeof(MotorHealth));
+    }
+    return true;
+}
+
+} // namespace rc
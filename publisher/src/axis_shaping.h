@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Maps raw joystick axis values to normalized inputs.
+//
+// The static part of the pipeline (deadzone, expo curve and scale) is
+// precomputed into a table indexed by the raw value, so shaping an event
+// is a single load. The optional low-pass filter depends on time and runs
+// on the publishing side.
+
+struct AxisShaping
+{
+    float deadzone = 0.0f; // fraction of the range around center mapped to 0
+    float expo = 0.0f;     // 0 linear, 1 cubic
+    float scale = 1.0f;
+    float cutoff_hz = 0.0f; // low-pass filter cutoff, 0 disables
+};
+
+// Parses "deadzone=0.05,expo=0.3,scale=1,cutoff=5" on top of shaping.
+// Returns false on unknown keys or invalid values.
+inline bool parse_axis_shaping(const std::string &spec, AxisShaping *shaping)
+{
+    std::istringstream stream(spec);
+    std::string item;
+
+    while (std::getline(stream, item, ','))
+    {
+        if (item.empty())
+        {
+            continue;
+        }
+
+        size_t separator = item.find('=');
+        if (separator == std::string::npos)
+        {
+            return false;
+        }
+
+        std::string name = item.substr(0, separator);
+        float value;
+        try
+        {
+            value = std::stof(item.substr(separator + 1));
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+
+        if (name == "deadzone" && value >= 0.0f && value < 1.0f)
+        {
+            shaping->deadzone = value;
+        }
+        else if (name == "expo" && value >= 0.0f && value <= 1.0f)
+        {
+            shaping->expo = value;
+        }
+        else if (name == "scale")
+        {
+            shaping->scale = value;
+        }
+        else if (name == "cutoff" && value >= 0.0f)
+        {
+            shaping->cutoff_hz = value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+class AxisShaper
+{
+public:
+    // sign flips the axis direction on top of the configured scale
+    AxisShaper(const AxisShaping &shaping, float sign) : table_(65536)
+    {
+        for (int raw = -32768; raw <= 32767; raw++)
+        {
+            float x = std::max(-1.0f, raw / 32767.0f);
+            float magnitude = std::abs(x);
+
+            magnitude = magnitude <= shaping.deadzone ? 0.0f : (magnitude - shaping.deadzone) / (1.0f - shaping.deadzone);
+            magnitude = (1.0f - shaping.expo) * magnitude + shaping.expo * magnitude * magnitude * magnitude;
+
+            table_[static_cast<uint16_t>(raw)] = std::copysign(magnitude, x) * shaping.scale * sign;
+        }
+    }
+
+    float shape(int16_t raw) const { return table_[static_cast<uint16_t>(raw)]; }
+
+private:
+    std::vector<float> table_;
+};
+
+// First order low-pass filter for irregularly spaced samples
+class LowPassFilter
+{
+public:
+    explicit LowPassFilter(float cutoff_hz) : time_constant_us_(cutoff_hz > 0.0f ? 1e6f / (2.0f * M_PI * cutoff_hz) : 0.0f) {}
+
+    float update(float target, uint64_t now_us)
+    {
+        if (time_constant_us_ <= 0.0f || last_us_ == 0)
+        {
+            value_ = target;
+        }
+        else
+        {
+            float alpha = 1.0f - std::exp(-static_cast<float>(now_us - last_us_) / time_constant_us_);
+            value_ += alpha * (target - value_);
+
+            // Snap once close, so a released stick reaches exactly zero
+            if (std::abs(target - value_) < 1e-3f)
+            {
+                value_ = target;
+            }
+        }
+
+        last_us_ = now_us;
+        return value_;
+    }
+
+    // True while the output still moves towards the last target
+    bool settling(float target) const { return value_ != target; }
+
+private:
+    const float time_constant_us_;
+    float value_ = 0.0f;
+    uint64_t last_us_ = 0;
+};
@@ -0,0 +1,66 @@
+#include "device_watcher.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <climits>
+
+DeviceWatcher::DeviceWatcher()
+{
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+DeviceWatcher::~DeviceWatcher()
+{
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+bool DeviceWatcher::watch(const std::string &path, unsigned int id)
+{
+    size_t separator = path.rfind('/');
+    std::string directory = separator == std::string::npos ? "." : separator == 0 ? "/" : path.substr(0, separator);
+    std::string name = separator == std::string::npos ? path : path.substr(separator + 1);
+
+    // Watching the same directory again returns the same descriptor
+    int descriptor = inotify_add_watch(fd_, directory.c_str(), IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+
+    if (descriptor < 0)
+    {
+        return false;
+    }
+
+    watches_.push_back({descriptor, name, id});
+    return true;
+}
+
+void DeviceWatcher::read(const std::function<void(unsigned int id, bool present)> &handler)
+{
+    alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+    ssize_t bytes;
+    while ((bytes = ::read(fd_, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *position = buffer; position < buffer + bytes;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(position);
+            position += sizeof(inotify_event) + event->len;
+
+            if (event->len == 0)
+            {
+                continue;
+            }
+
+            bool present = event->mask & (IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+
+            for (const Watch &watch : watches_)
+            {
+                if (watch.descriptor == event->wd && watch.name == event->name)
+                {
+                    handler(watch.id, present);
+                }
+            }
+        }
+    }
+}
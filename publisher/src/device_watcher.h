@@ -0,0 +1,40 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Watches device paths with inotify and reports when they appear or
+// disappear, e.g. a joystick being plugged in. New device nodes are often
+// created before udev grants access to them, so a permission change is
+// reported as the path appearing again.
+class DeviceWatcher
+{
+public:
+    DeviceWatcher();
+    ~DeviceWatcher();
+
+    DeviceWatcher(const DeviceWatcher &) = delete;
+    DeviceWatcher &operator=(const DeviceWatcher &) = delete;
+
+    int file_descriptor() const { return fd_; }
+
+    // Watches path under id. Returns false if its directory cannot be
+    // watched.
+    bool watch(const std::string &path, unsigned int id);
+
+    // Reads queued notifications without blocking and calls handler for
+    // every watched path that changed
+    void read(const std::function<void(unsigned int id, bool present)> &handler);
+
+private:
+    struct Watch
+    {
+        int descriptor;
+        std::string name;
+        unsigned int id;
+    };
+
+    int fd_ = -1;
+    std::vector<Watch> watches_;
+};
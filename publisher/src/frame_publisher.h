@@ -0,0 +1,102 @@
+#pragma once
+
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zenoh.hxx>
+#include <command_frame.h>
+
+// Publishes command frames on one key.
+//
+// Frames are encoded into a buffer allocated once, which zenoh copies into
+// a payload it allocates per message. When built with zenoh shared memory (SHARED_MEMORY) and
+// enabled, frames are instead encoded directly into buffers of a shared
+// memory segment and handed to zenoh without a copy. If the segment has no
+// free buffer, e.g. a slow subscriber still holds them, the frame falls
+// back to the copying path.
+class FramePublisher
+{
+public:
+    FramePublisher(zenoh::Session &session, const std::string &key, rc::FrameFormat format, bool shared_memory)
+        : publisher_(zenoh::expect(session.declare_publisher(key))), format_(format), message_(rc::frame_size(format))
+    {
+#ifdef SHARED_MEMORY
+        if (shared_memory)
+        {
+            // Room for frames in flight, zenoh reclaims them once delivered
+            std::string id = "rc_" + std::to_string(getpid()) + "_" + key;
+            std::replace(id.begin(), id.end(), '/', '_');
+
+            auto manager = zenoh::shm_manager_new(session, id.c_str(), message_.size() * SHM_FRAMES);
+            if (std::holds_alternative<zenoh::ShmManager>(manager))
+            {
+                shm_manager_ = std::make_unique<zenoh::ShmManager>(std::move(std::get<zenoh::ShmManager>(manager)));
+            }
+        }
+#else
+        (void)shared_memory;
+#endif
+    }
+
+    // True if frames are published from shared memory
+    bool shared_memory() const
+    {
+#ifdef SHARED_MEMORY
+        return shm_manager_ != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    // Frames that did not fit into shared memory and were copied instead
+    uint64_t shm_fallbacks() const { return shm_fallbacks_; }
+
+    void publish(const rc::Command &command, uint32_t sequence, uint64_t timestamp_us, uint8_t flags = 0)
+    {
+#ifdef SHARED_MEMORY
+        if (shm_manager_)
+        {
+            auto buffer = shm_manager_->alloc(message_.size());
+            if (!std::holds_alternative<zenoh::Shmbuf>(buffer))
+            {
+                // Collect buffers released by zenoh and try once more
+                shm_manager_->gc();
+                buffer = shm_manager_->alloc(message_.size());
+            }
+
+            if (std::holds_alternative<zenoh::Shmbuf>(buffer))
+            {
+                zenoh::Shmbuf &shmbuf = std::get<zenoh::Shmbuf>(buffer);
+                rc::encode_frame(reinterpret_cast<uint8_t *>(shmbuf.ptr()), command, format_, sequence, timestamp_us, flags);
+                shmbuf.set_length(message_.size());
+                publisher_.put_owned(std::move(shmbuf).into_payload());
+                return;
+            }
+
+            shm_fallbacks_++;
+        }
+#endif
+
+        rc::encode_frame(message_.data(), command, format_, sequence, timestamp_us, flags);
+        publisher_.put(message_);
+    }
+
+    // Publishes arbitrary bytes, e.g. malformed messages for load tests
+    void publish_raw(const std::vector<uint8_t> &message)
+    {
+        publisher_.put(message);
+    }
+
+private:
+    static const size_t SHM_FRAMES = 256;
+
+    zenoh::Publisher publisher_;
+    const rc::FrameFormat format_;
+    std::vector<uint8_t> message_;
+#ifdef SHARED_MEMORY
+    std::unique_ptr<zenoh::ShmManager> shm_manager_;
+#endif
+    uint64_t shm_fallbacks_ = 0;
+};
@@ -0,0 +1,272 @@
+#include "input_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <command_frame.h>
+
+int JoystickDevice::read(InputEvent *events, int max_events)
+{
+    if (max_events < 2)
+    {
+        return 0;
+    }
+
+    buffer_.resize(max_events - 1);
+
+    int count = joystick_.sampleBatch(buffer_.data(), max_events - 1);
+
+    if (count <= 0)
+    {
+        return count;
+    }
+
+    // js timestamps are in milliseconds on an unrelated clock
+    uint64_t now_us = rc::monotonic_us();
+
+    int out = 0;
+    for (int i = 0; i < count; i++)
+    {
+        JoystickEvent &event = buffer_[i];
+
+        if (event.isAxis())
+        {
+            events[out++] = {now_us, event.value, InputEventType::AXIS, event.number};
+        }
+        else if (event.isButton())
+        {
+            events[out++] = {now_us, event.value, InputEventType::BUTTON, event.number};
+        }
+    }
+
+    events[out++] = {now_us, 0, InputEventType::REPORT, 0};
+    return out;
+}
+
+static bool test_bit(const std::vector<uint8_t> &bits, int bit)
+{
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+EvdevDevice::EvdevDevice(const std::string &path)
+    : axes_(ABS_CNT), buttons_(KEY_CNT, -1)
+{
+    fd_ = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+
+    if (fd_ < 0)
+    {
+        return;
+    }
+
+    // A FIFO without a writer reads as EOF. Hold a write end until the
+    // first data arrives, so it reads as empty until the writer connects
+    // and the end of the stream is when that writer closes it.
+    struct stat info;
+    if (fstat(fd_, &info) == 0 && S_ISFIFO(info.st_mode))
+    {
+        writer_fd_ = open(path.c_str(), O_WRONLY | O_NONBLOCK);
+    }
+
+    std::vector<uint8_t> abs_bits(ABS_CNT / 8 + 1);
+    std::vector<uint8_t> key_bits(KEY_CNT / 8 + 1);
+
+    is_device_ = ioctl(fd_, EVIOCGBIT(EV_ABS, abs_bits.size()), abs_bits.data()) >= 0 &&
+                 ioctl(fd_, EVIOCGBIT(EV_KEY, key_bits.size()), key_bits.data()) >= 0;
+
+    if (!is_device_)
+    {
+        for (int code = 0; code < ABS_CNT; code++)
+        {
+            axes_[code].number = code < 256 ? code : -1;
+        }
+        for (int code = BTN_MISC; code < KEY_CNT && code - BTN_MISC < 256; code++)
+        {
+            buttons_[code] = code - BTN_MISC;
+        }
+        return;
+    }
+
+    char name[256] = {};
+    if (ioctl(fd_, EVIOCGNAME(sizeof(name) - 1), name) >= 0)
+    {
+        name_ = name;
+    }
+
+    // Report timestamps on the clock used for frame timestamps
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd_, EVIOCSCLOCKID, &clock);
+
+    // Same numbering as joydev: present axes in code order, then buttons
+    // from BTN_JOYSTICK up, then BTN_MISC up to BTN_JOYSTICK
+    int axis_count = 0;
+    for (int code = 0; code < ABS_CNT && axis_count < 256; code++)
+    {
+        input_absinfo info;
+        if (test_bit(abs_bits, code) && ioctl(fd_, EVIOCGABS(code), &info) >= 0)
+        {
+            axes_[code] = {axis_count++, info.minimum, info.maximum};
+        }
+    }
+
+    int button_count = 0;
+    for (int code = BTN_JOYSTICK; code < KEY_CNT && button_count < 256; code++)
+    {
+        if (test_bit(key_bits, code))
+        {
+            buttons_[code] = button_count++;
+        }
+    }
+    for (int code = BTN_MISC; code < BTN_JOYSTICK && button_count < 256; code++)
+    {
+        if (test_bit(key_bits, code))
+        {
+            buttons_[code] = button_count++;
+        }
+    }
+
+    // Start with the current axis positions, like js init events
+    queue_axis_state(rc::monotonic_us());
+}
+
+EvdevDevice::~EvdevDevice()
+{
+    if (writer_fd_ >= 0)
+    {
+        close(writer_fd_);
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+int16_t EvdevDevice::scale(const Axis &axis, int32_t value) const
+{
+    if (axis.maximum <= axis.minimum)
+    {
+        return std::max(-32767, std::min(32767, value));
+    }
+
+    double normalized = 2.0 * (value - axis.minimum) / (axis.maximum - axis.minimum) - 1.0;
+    return static_cast<int16_t>(std::lround(std::max(-1.0, std::min(1.0, normalized)) * 32767));
+}
+
+void EvdevDevice::queue_axis_state(uint64_t time_us)
+{
+    for (int code = 0; code < ABS_CNT; code++)
+    {
+        input_absinfo info;
+        if (axes_[code].number >= 0 && ioctl(fd_, EVIOCGABS(code), &info) >= 0)
+        {
+            ready_.push_back({time_us, scale(axes_[code], info.value), InputEventType::AXIS,
+                              static_cast<uint8_t>(axes_[code].number)});
+        }
+    }
+    ready_.push_back({time_us, 0, InputEventType::REPORT, 0});
+}
+
+int EvdevDevice::read(InputEvent *events, int max_events)
+{
+    if (ready_position_ == ready_.size())
+    {
+        ready_.clear();
+        ready_position_ = 0;
+
+        // Pipes may split events, keep a partial event for the next read
+        static_assert(sizeof(partial_) >= sizeof(input_event), "partial event buffer too small");
+        input_event raw[64];
+        std::memcpy(raw, partial_, partial_size_);
+        ssize_t bytes = ::read(fd_, reinterpret_cast<uint8_t *>(raw) + partial_size_, sizeof(raw) - partial_size_);
+
+        if (bytes < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (bytes == 0)
+        {
+            // End of a file or the FIFO writer closed it
+            return -1;
+        }
+        if (writer_fd_ >= 0)
+        {
+            close(writer_fd_);
+            writer_fd_ = -1;
+        }
+
+        size_t total = partial_size_ + bytes;
+        int count = total / sizeof(input_event);
+        partial_size_ = total % sizeof(input_event);
+        std::memcpy(partial_, reinterpret_cast<uint8_t *>(raw) + count * sizeof(input_event), partial_size_);
+
+        uint64_t read_us = rc::monotonic_us();
+
+        for (int i = 0; i < count; i++)
+        {
+            const input_event &event = raw[i];
+            uint64_t time_us = is_device_ ? event.input_event_sec * 1000000ull + event.input_event_usec : read_us;
+
+            if (event.type == EV_SYN && event.code == SYN_DROPPED)
+            {
+                // The kernel buffer overflowed: drop everything up to the
+                // next report and resynchronize the axes from the device
+                pending_.clear();
+                dropping_ = true;
+            }
+            else if (event.type == EV_SYN && event.code == SYN_REPORT)
+            {
+                if (dropping_)
+                {
+                    dropping_ = false;
+                    if (is_device_)
+                    {
+                        queue_axis_state(time_us);
+                    }
+                    continue;
+                }
+
+                ready_.insert(ready_.end(), pending_.begin(), pending_.end());
+                ready_.push_back({time_us, 0, InputEventType::REPORT, 0});
+                pending_.clear();
+            }
+            else if (dropping_)
+            {
+                continue;
+            }
+            else if (event.type == EV_ABS && event.code < ABS_CNT && axes_[event.code].number >= 0)
+            {
+                const Axis &axis = axes_[event.code];
+                int16_t value = is_device_ ? scale(axis, event.value) : scale(Axis(), event.value);
+                pending_.push_back({time_us, value, InputEventType::AXIS, static_cast<uint8_t>(axis.number)});
+            }
+            else if (event.type == EV_KEY && event.code < KEY_CNT && buttons_[event.code] >= 0)
+            {
+                // Auto-repeat (value 2) is not a press
+                if (event.value == 0 || event.value == 1)
+                {
+                    pending_.push_back({time_us, static_cast<int16_t>(event.value), InputEventType::BUTTON,
+                                        static_cast<uint8_t>(buttons_[event.code])});
+                }
+            }
+        }
+    }
+
+    int count = std::min<int>(max_events, ready_.size() - ready_position_);
+    std::copy_n(ready_.begin() + ready_position_, count, events);
+    ready_position_ += count;
+    return count;
+}
+
+std::unique_ptr<InputDevice> open_input_device(const std::string &evdev_path, unsigned int index)
+{
+    if (!evdev_path.empty())
+    {
+        return std::unique_ptr<InputDevice>(new EvdevDevice(evdev_path));
+    }
+    return std::unique_ptr<InputDevice>(new JoystickDevice(index));
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <joystick.hh>
+
+// Joystick input sources. Every backend delivers axis and button events
+// in the js numbering and value range (axes -32767..32767), grouped into
+// reports: a REPORT event closes a set of changes that belong together.
+
+enum class InputEventType : uint8_t
+{
+    AXIS,
+    BUTTON,
+    REPORT,
+};
+
+struct InputEvent
+{
+    uint64_t time_us; // monotonic time the kernel saw the event
+    int16_t value;
+    InputEventType type;
+    uint8_t number;
+};
+
+class InputDevice
+{
+public:
+    virtual ~InputDevice() = default;
+
+    virtual bool is_open() const = 0;
+    virtual int file_descriptor() const = 0;
+
+    // Reads queued events without blocking and returns up to max_events
+    // of them. Only complete reports are returned; a report longer than
+    // max_events is split across calls. Call again until it returns 0
+    // (nothing complete is queued) or -1 (the device is gone).
+    virtual int read(InputEvent *events, int max_events) = 0;
+};
+
+// Legacy /dev/input/jsN interface. It has millisecond timestamps and no
+// report boundaries, so each read is treated as one report.
+class JoystickDevice : public InputDevice
+{
+public:
+    explicit JoystickDevice(unsigned int index) : joystick_(index) {}
+
+    bool is_open() const override { return joystick_.getFileDescriptor() >= 0; }
+    int file_descriptor() const override { return joystick_.getFileDescriptor(); }
+    int read(InputEvent *events, int max_events) override;
+
+private:
+    Joystick joystick_;
+    std::vector<JoystickEvent> buffer_;
+};
+
+// evdev /dev/input/eventN interface. Events are grouped by SYN_REPORT and
+// keep the kernel's microsecond timestamps on the monotonic clock.
+//
+// Axes and buttons are numbered like the js driver does, so the same
+// axis and button options work with both backends. A file or FIFO with a
+// recorded stream of struct input_event has no device capabilities: then
+// axis numbers are the ABS codes, button numbers are the key codes minus
+// BTN_MISC, values are passed through and timestamps are the read time.
+class EvdevDevice : public InputDevice
+{
+public:
+    explicit EvdevDevice(const std::string &path);
+    ~EvdevDevice() override;
+
+    EvdevDevice(const EvdevDevice &) = delete;
+    EvdevDevice &operator=(const EvdevDevice &) = delete;
+
+    bool is_open() const override { return fd_ >= 0; }
+    int file_descriptor() const override { return fd_; }
+    int read(InputEvent *events, int max_events) override;
+
+    // Device name reported by the driver, empty for files and FIFOs
+    const std::string &name() const { return name_; }
+
+private:
+    struct Axis
+    {
+        int number = -1; // js axis number, -1 if not mapped
+        int32_t minimum = 0;
+        int32_t maximum = 0;
+    };
+
+    int16_t scale(const Axis &axis, int32_t value) const;
+    void queue_axis_state(uint64_t time_us);
+
+    int fd_ = -1;
+    int writer_fd_ = -1;                 // own write end of a FIFO, until data arrives
+    bool is_device_ = false;
+    bool dropping_ = false;
+    std::string name_;
+    std::vector<Axis> axes_;             // indexed by ABS code
+    std::vector<int> buttons_;           // js button number by key code, -1 if not mapped
+    std::vector<InputEvent> pending_;    // events of the current, incomplete report
+    std::vector<InputEvent> ready_;      // complete reports not yet returned
+    size_t ready_position_ = 0;
+    uint8_t partial_[32];                // bytes of a split struct input_event
+    size_t partial_size_ = 0;
+};
+
+// Opens the evdev backend if path is set, otherwise /dev/input/js<index>
+std::unique_ptr<InputDevice> open_input_device(const std::string &evdev_path, unsigned int index);
@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <popl.hpp>
+#include <command_frame.h>
+#include "input_device.h"
+
+// Records joystick events with their timestamps and replays them as an
+// evdev event stream into a FIFO, which the publisher reads with --evdev.
+// Replayed axis numbers become ABS codes and button numbers key codes
+// from BTN_MISC, which the publisher maps back to the recorded numbers.
+
+static const char RECORDING_MAGIC[4] = {'R', 'C', 'J', 'R'};
+static const uint32_t RECORDING_VERSION = 1;
+
+struct RecordingHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+bool interrupted = false;
+
+void interrupt_handler(int)
+{
+    interrupted = true;
+}
+
+static int record(const std::string &evdev_path, unsigned int index, const std::string &path)
+{
+    auto device = open_input_device(evdev_path, index);
+
+    if (!device->is_open())
+    {
+        std::cerr << "Joystick not found" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+    {
+        std::cerr << "Cannot create " << path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    RecordingHeader header = {};
+    std::memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    header.version = RECORDING_VERSION;
+    header.record_size = sizeof(InputEvent);
+    fwrite(&header, sizeof(header), 1, file);
+
+    printf("Recording to %s, press Ctrl+C to stop\n", path.c_str());
+
+    InputEvent events[64];
+    uint64_t events_written = 0;
+    uint64_t reports = 0;
+    pollfd pfd = {device->file_descriptor(), POLLIN, 0};
+
+    while (!interrupted)
+    {
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            continue;
+        }
+
+        int count;
+        while ((count = device->read(events, 64)) > 0)
+        {
+            fwrite(events, sizeof(InputEvent), count, file);
+            events_written += count;
+            reports += std::count_if(events, events + count, [](const InputEvent &event)
+                                     { return event.type == InputEventType::REPORT; });
+        }
+
+        // Keep the recording usable if the process is killed
+        fflush(file);
+
+        if (count < 0)
+        {
+            std::cerr << "Joystick disconnected" << std::endl;
+            break;
+        }
+    }
+
+    fclose(file);
+    printf("Recorded %lu events in %lu reports\n", (unsigned long)events_written, (unsigned long)reports);
+    return EXIT_SUCCESS;
+}
+
+static bool load(const std::string &path, std::vector<InputEvent> *events)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+    {
+        std::cerr << "Cannot open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    RecordingHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != RECORDING_VERSION || header.record_size != sizeof(InputEvent))
+    {
+        std::cerr << path << " is not a joystick recording" << std::endl;
+        fclose(file);
+        return false;
+    }
+
+    InputEvent event;
+    while (fread(&event, sizeof(event), 1, file) == 1)
+    {
+        events->push_back(event);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static void sleep_until_us(uint64_t time_us)
+{
+    timespec deadline = {static_cast<time_t>(time_us / 1000000), static_cast<long>(time_us % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR && !interrupted)
+    {
+    }
+}
+
+static int replay(const std::string &path, const std::string &output, float speed, unsigned int repeat)
+{
+    std::vector<InputEvent> events;
+
+    if (!load(path, &events))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (events.empty())
+    {
+        std::cerr << "Recording is empty" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int fd = STDOUT_FILENO;
+
+    if (output != "-")
+    {
+        // Blocks until the publisher opens the FIFO
+        struct stat info;
+        if (stat(output.c_str(), &info) != 0 && mkfifo(output.c_str(), 0644) != 0)
+        {
+            std::cerr << "Cannot create FIFO " << output << ": " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        printf("Waiting for a reader on %s\n", output.c_str());
+        fd = open(output.c_str(), O_WRONLY);
+
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open " << output << ": " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const uint64_t first_us = events.front().time_us;
+    const uint64_t duration_us = events.back().time_us - first_us;
+
+    std::vector<input_event> report;
+    uint64_t reports = 0;
+    uint64_t lateness_sum_us = 0;
+    uint64_t lateness_max_us = 0;
+    bool failed = false;
+
+    uint64_t start_us = rc::monotonic_us();
+
+    for (unsigned int pass = 0; pass < std::max(1u, repeat) && !interrupted && !failed; pass++)
+    {
+        uint64_t pass_start_us = rc::monotonic_us();
+
+        for (const InputEvent &event : events)
+        {
+            input_event raw = {};
+            raw.input_event_sec = event.time_us / 1000000;
+            raw.input_event_usec = event.time_us % 1000000;
+
+            if (event.type == InputEventType::AXIS)
+            {
+                raw.type = EV_ABS;
+                raw.code = event.number;
+                raw.value = event.value;
+                report.push_back(raw);
+                continue;
+            }
+            if (event.type == InputEventType::BUTTON)
+            {
+                raw.type = EV_KEY;
+                raw.code = BTN_MISC + event.number;
+                raw.value = event.value;
+                report.push_back(raw);
+                continue;
+            }
+
+            raw.type = EV_SYN;
+            raw.code = SYN_REPORT;
+            report.push_back(raw);
+
+            // Pace reports like the recording, relative to the pass start
+            if (speed > 0.0f)
+            {
+                uint64_t due_us = pass_start_us + (event.time_us - first_us) / speed;
+                sleep_until_us(due_us);
+
+                uint64_t lateness_us = rc::monotonic_us() - due_us;
+                lateness_sum_us += lateness_us;
+                lateness_max_us = std::max(lateness_max_us, lateness_us);
+            }
+
+            // One write per report, atomic on a FIFO up to PIPE_BUF
+            ssize_t bytes = write(fd, report.data(), report.size() * sizeof(input_event));
+            if (bytes < 0)
+            {
+                std::cerr << "Write failed: " << strerror(errno) << std::endl;
+                failed = true;
+                break;
+            }
+
+            report.clear();
+            reports++;
+
+            if (interrupted)
+            {
+                break;
+            }
+        }
+    }
+
+    double wall_s = (rc::monotonic_us() - start_us) / 1e6;
+
+    if (fd != STDOUT_FILENO)
+    {
+        close(fd);
+    }
+
+    fprintf(stderr, "Replayed %lu reports (recording %.1f s) in %.3f s, %.0f reports/s\n", (unsigned long)reports,
+            duration_us / 1e6, wall_s, reports / std::max(wall_s, 1e-9));
+    if (speed > 0.0f && reports > 0)
+    {
+        fprintf(stderr, "Pacing lateness: mean %.1f us, max %lu us\n", (double)lateness_sum_us / reports,
+                (unsigned long)lateness_max_us);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    // Register interrupt handler, a closed FIFO ends the replay
+    struct sigaction sig_int_handler;
+    sig_int_handler.sa_handler = interrupt_handler;
+    sigemptyset(&sig_int_handler.sa_mask);
+    sig_int_handler.sa_flags = 0;
+    sigaction(SIGINT, &sig_int_handler, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Parse arguments
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto device_index = op.add<popl::Value<unsigned int>>("d", "device", "device index to record", 0);
+    auto evdev_path = op.add<popl::Value<std::string>>("e", "evdev", "record /dev/input/eventN instead of the js device");
+    auto output = op.add<popl::Value<std::string>>("o", "output", "recording file to write", "joystick_recording.bin");
+    auto input = op.add<popl::Value<std::string>>("i", "replay", "recording file to replay instead of recording");
+    auto fifo = op.add<popl::Value<std::string>>("f", "fifo", "FIFO to replay into, created if missing, - for stdout", "joystick.fifo");
+    auto speed = op.add<popl::Value<float>>("s", "speed", "replay speed relative to real time, 0 for as fast as possible", 1.0);
+    auto repeat = op.add<popl::Value<unsigned int>>("n", "repeat", "number of replay passes, for benchmarking", 1);
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (input->is_set())
+    {
+        return replay(input->value(), fifo->value(), speed->value(), repeat->value());
+    }
+
+    return record(evdev_path->is_set() ? evdev_path->value() : "", device_index->value(), output->value());
+}
@@ -1,15 +1,97 @@
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iterator>
 #include <thread>
-#include <mutex>
 #include <iostream>
 #include <string>
 #include <cmath>
-#include <joystick.hh>
 #include <popl.hpp>
 #include <unistd.h>
 #include <zenoh.hxx>
+#include <command_frame.h>
+#include <metrics.h>
+#include <seqlock.h>
+#include "axis_shaping.h"
+#include "device_watcher.h"
+#include "frame_publisher.h"
+#include "input_device.h"
+#include "publish_policy.h"
 
-bool interrupted = false;
+// Set by the signal handler and the joystick thread, lock-free so both
+// may write it
+std::atomic<bool> interrupted(false);
+
+// Input state shared with the publishing loop, written only by the
+// joystick thread
+struct InputState
+{
+    bool connected = false;
+    uint32_t session = 0; // changes whenever the joystick is attached
+    float move_x = 0.0;
+    float move_y = 0.0;
+    float turn = 0.0;
+    float max_move_speed = 0.0;
+    float max_turn_speed = 0.0;
+    uint64_t time_us = 0;
+};
+
+// Publishing state of one joystick session
+struct ControllerOutput
+{
+    ControllerOutput(uint32_t session, const PublishPolicy::Config &policy_config, float move_x_cutoff_hz,
+                     float move_y_cutoff_hz, float turn_cutoff_hz)
+        : session(session), policy(policy_config), move_x_filter(move_x_cutoff_hz),
+          move_y_filter(move_y_cutoff_hz), turn_filter(turn_cutoff_hz)
+    {
+    }
+
+    const uint32_t session;
+    PublishPolicy policy;
+    LowPassFilter move_x_filter;
+    LowPassFilter move_y_filter;
+    LowPassFilter turn_filter;
+    bool filters_settling = false;
+    uint64_t last_publish_us = 0;
+};
+
+// A joystick device path that may come and go, and the key it is
+// published on
+struct Controller
+{
+    Controller(unsigned int index, std::string path, zenoh::Session &session, std::string key, rc::FrameFormat format, bool shared_memory)
+        : index(index), path(std::move(path)), key(key), publisher(session, key, format, shared_memory)
+    {
+    }
+
+    const unsigned int index;
+    const std::string path;
+    const std::string key;
+    rc::SeqLock<InputState> shared_input;
+
+    // Joystick thread only
+    std::unique_ptr<InputDevice> device;
+    bool stream = false; // recorded events from a file or FIFO
+    bool always_ready = false; // not pollable, read on every iteration
+    InputState input;
+    short axis_values[256];
+    bool axis_updated[256] = {};
+    bool speed_changed = false;
+    unsigned int pressed_buttons[64];
+    int pressed_count = 0;
+
+    // Publishing loop only
+    FramePublisher publisher;
+    std::unique_ptr<ControllerOutput> output;
+    uint32_t sequence = 0;
+    uint8_t flags = rc::FLAG_SESSION_START;
+};
 
 void interrupt_handler(int)
 {
@@ -29,15 +111,31 @@ int main(int argc, char *argv[])
     popl::OptionParser op("Allowed options");
     auto help = op.add<popl::Switch>("h", "help", "produce help message");
     auto device_index = op.add<popl::Value<unsigned int>>("d", "device", "device index", 0);
+    auto all_devices = op.add<popl::Switch>("a", "all-devices", "publish every joystick /dev/input/jsN with N below --max-devices on its own key");
+    auto max_devices = op.add<popl::Value<unsigned int>>("", "max-devices", "number of joystick indexes watched with --all-devices", 8);
+    auto evdev_path = op.add<popl::Value<std::string>>("e", "evdev", "read /dev/input/eventN (or a recorded event stream) instead of the js device");
     auto move_x_axis = op.add<popl::Value<unsigned int>>("", "move-x-axis", "movement x-axis number", 3);
     auto move_y_axis = op.add<popl::Value<unsigned int>>("", "move-y-axis", "movement y-axis number", 4);
     auto turn_axis = op.add<popl::Value<unsigned int>>("", "turn-axis", "turn axis number", 0);
     auto initial_max_move_speed = op.add<popl::Value<float>>("", "move-speed", "max moving speed (m/s)", 0.2);
     auto initial_max_turn_speed = op.add<popl::Value<float>>("", "turn-speed", "max turning speed (rad/s)", 0.5);
     auto key = op.add<popl::Value<std::string>>("", "key", "zenoh key", "rc/{device index}");
+    auto shaping = op.add<popl::Value<std::string>>("", "shaping", "axis shaping for all axes, e.g. deadzone=0.05,expo=0.3,scale=1,cutoff=5", "");
+    auto move_x_shaping = op.add<popl::Value<std::string>>("", "move-x-shaping", "movement x-axis shaping, overrides --shaping", "");
+    auto move_y_shaping = op.add<popl::Value<std::string>>("", "move-y-shaping", "movement y-axis shaping, overrides --shaping", "");
+    auto turn_shaping = op.add<popl::Value<std::string>>("", "turn-shaping", "turn axis shaping, overrides --shaping", "");
     auto inc_speed_button = op.add<popl::Value<unsigned int>>("", "inc-speed-button", "increase speed button number", 3);
     auto dec_speed_button = op.add<popl::Value<unsigned int>>("", "dec-speed-button", "decrease speed button number", 2);
     auto reset_speed_button = op.add<popl::Value<unsigned int>>("", "reset-speed-button", "reset speed button number", 0);
+    auto format = op.add<popl::Value<std::string>>("", "format", "message format: legacy, float or fixed", "float");
+    auto publish_mode = op.add<popl::Value<std::string>>("", "publish-mode", "periodic or on-change", "periodic");
+    auto period = op.add<popl::Value<unsigned int>>("", "period", "publish period in periodic mode (ms)", 10);
+    auto min_interval = op.add<popl::Value<float>>("", "min-interval", "minimum time between messages in on-change mode (ms)", 5);
+    auto heartbeat = op.add<popl::Value<unsigned int>>("", "heartbeat", "max heartbeat interval in on-change mode, keep below the subscriber kill timeout (ms)", 100);
+    auto deadband = op.add<popl::Value<float>>("", "deadband", "minimum speed change to publish in on-change mode (m/s or rad/s)", 0.005);
+    auto shared_memory = op.add<popl::Switch>("", "shm", "publish from zenoh shared memory, if built with it");
+    auto metrics_port = op.add<popl::Value<unsigned int>>("", "metrics-port", "serve Prometheus metrics on this HTTP port, 0 to disable", 0);
+    auto metrics_address = op.add<popl::Value<std::string>>("", "metrics-address", "metrics HTTP server address", "127.0.0.1");
 
     try
     {
@@ -57,121 +155,503 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Find joystick
-    Joystick joystick(device_index->value());
+    rc::FrameFormat frame_format;
+
+    if (format->value() == "legacy")
+    {
+        frame_format = rc::FrameFormat::LEGACY;
+    }
+    else if (format->value() == "float")
+    {
+        frame_format = rc::FrameFormat::FLOAT;
+    }
+    else if (format->value() == "fixed")
+    {
+        frame_format = rc::FrameFormat::FIXED;
+    }
+    else
+    {
+        std::cerr << "Unknown message format: " << format->value() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    AxisShaping default_shaping;
+
+    if (!parse_axis_shaping(shaping->value(), &default_shaping))
+    {
+        std::cerr << "Invalid axis shaping: " << shaping->value() << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    if (!joystick.isFound())
+    AxisShaping move_x_config = default_shaping;
+    AxisShaping move_y_config = default_shaping;
+    AxisShaping turn_config = default_shaping;
+
+    if (!parse_axis_shaping(move_x_shaping->value(), &move_x_config) ||
+        !parse_axis_shaping(move_y_shaping->value(), &move_y_config) ||
+        !parse_axis_shaping(turn_shaping->value(), &turn_config))
+    {
+        std::cerr << "Invalid axis shaping" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Stick up and left are negative on the js axes
+    AxisShaper move_x_shaper(move_x_config, 1.0f);
+    AxisShaper move_y_shaper(move_y_config, -1.0f);
+    AxisShaper turn_shaper(turn_config, -1.0f);
+
+    PublishPolicy::Config policy_config;
+
+    if (publish_mode->value() == "periodic" || publish_mode->value() == "on-change")
+    {
+        policy_config.on_change = publish_mode->value() == "on-change";
+    }
+    else
     {
-        std::cerr << "Joystick not found" << std::endl;
+        std::cerr << "Unknown publish mode: " << publish_mode->value() << std::endl;
         return EXIT_FAILURE;
     }
 
-    // Auto-generate publisher key if not set
-    if (!key->is_set())
+    policy_config.period_us = period->value() * 1000;
+    policy_config.min_interval_us = min_interval->value() * 1000;
+    policy_config.max_heartbeat_us = heartbeat->value() * 1000;
+    policy_config.min_heartbeat_us = std::min<uint64_t>(std::max<uint64_t>(policy_config.min_interval_us * 4, 20000), policy_config.max_heartbeat_us);
+    policy_config.deadband = deadband->value();
+
+    if (policy_config.on_change && heartbeat->value() >= 250)
+    {
+        std::cerr << "Warning: heartbeat is not below the subscriber's default kill timeout (250 ms)" << std::endl;
+    }
+
+    // One controller per joystick, each published on its own key
+    std::deque<Controller> controllers;
+    unsigned int device_count = all_devices->is_set() ? max_devices->value() : 1;
+
+    if (all_devices->is_set() && (evdev_path->is_set() || key->value().find("{device index}") == std::string::npos))
     {
-        key->set_value("rc/" + std::to_string(device_index->value()));
+        std::cerr << "--all-devices needs js devices and a key containing {device index}" << std::endl;
+        return EXIT_FAILURE;
     }
 
     // Start zenoh session
     zenoh::Config zenoh_config;
     zenoh_config.insert_json(Z_CONFIG_MODE_KEY, "\"peer\"");
     auto zenoh_session = zenoh::expect(zenoh::open(std::move(zenoh_config)));
-    auto zenoh_publisher = zenoh::expect(zenoh_session.declare_publisher(key->value()));
 
-    printf("Publisher key: %s\n", key->value().c_str());
+    for (unsigned int i = 0; i < device_count; i++)
+    {
+        unsigned int index = all_devices->is_set() ? i : device_index->value();
+        std::string path = evdev_path->is_set() ? evdev_path->value() : "/dev/input/js" + std::to_string(index);
+
+        // Substitute the device index into the key
+        std::string device_key = key->value();
+        size_t placeholder = device_key.find("{device index}");
+        if (placeholder != std::string::npos)
+        {
+            device_key.replace(placeholder, std::string("{device index}").size(), std::to_string(index));
+        }
+
+        controllers.emplace_back(index, path, zenoh_session, device_key, frame_format, shared_memory->is_set());
+    }
+
+    if (shared_memory->is_set() && !controllers.front().publisher.shared_memory())
+    {
+        std::cerr << "Shared memory not available, publishing from a copy" << std::endl;
+    }
+
+    // Metrics, updated lock-free from the input and publishing loops
+    metrics::Registry registry;
+    auto &joystick_events = registry.counter("rc_publisher_joystick_events_total", "Joystick events read");
+    auto &input_reports = registry.counter("rc_publisher_input_reports_total", "Complete joystick reports applied");
+    auto &joysticks_connected = registry.gauge("rc_publisher_joysticks_connected", "Joysticks currently attached");
+    auto &messages_published = registry.counter("rc_publisher_messages_published_total", "Command messages published");
+    auto &heartbeats_published = registry.counter("rc_publisher_heartbeats_published_total", "Messages published without input change in on-change mode");
+    auto &loop_period = registry.histogram("rc_publisher_loop_period_seconds", "Interval between published messages", metrics::exponential_buckets(1000, 1.5, 16));
+    auto &loop_jitter = registry.histogram("rc_publisher_loop_jitter_seconds", "Deviation of the publishing interval from the period in periodic mode", metrics::exponential_buckets(10, 2, 14));
+    auto &input_latency = registry.histogram("rc_publisher_input_latency_seconds", "Time from the joystick report to publishing it", metrics::exponential_buckets(10, 2, 16));
+
+    metrics::HttpServer metrics_server(registry);
+
+    if (metrics_port->value() > 0 && metrics_server.start(metrics_address->value(), metrics_port->value()))
+    {
+        printf("Metrics: http://%s:%u/metrics\n", metrics_address->value().c_str(), metrics_port->value());
+    }
+
     printf("Press Ctrl+C to exit\n");
 
-    // Use mutex to protect shared data
-    std::mutex mtx;
-    float move_x_input = 0.0;
-    float move_y_input = 0.0;
-    float turn_input = 0.0;
-    float max_move_speed = initial_max_move_speed->value();
-    float max_turn_speed = initial_max_turn_speed->value();
+    // Signals the publishing loop that the input changed or a joystick
+    // was attached or detached
+    int input_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-    // Read joystick events on separate thread
+    auto signal_input = [&]()
+    {
+        uint64_t one = 1;
+        if (write(input_event, &one, sizeof(one)) < 0)
+        {
+            // Counter overflow is impossible in practice, nothing to do
+        }
+    };
+
+    // Read joystick events on separate thread, one epoll loop for device
+    // hotplug notifications and all attached joysticks
     std::thread joystick_thread([&]()
                                 {
-        while (!interrupted)
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        DeviceWatcher watcher;
+        unsigned int connected = 0;
+        uint32_t session = 0;
+
+        // Notifications use the data value past the last controller
+        epoll_event watcher_event = {EPOLLIN, {}};
+        watcher_event.data.u64 = controllers.size();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watcher.file_descriptor(), &watcher_event);
+
+        // Controllers are registered by their index, addresses of deque
+        // elements cannot be subtracted
+        auto attach = [&](size_t i)
         {
-            usleep(1000); // 1ms
+            Controller &controller = controllers[i];
+            if (controller.device)
+            {
+                return;
+            }
 
-            // Attempt to sample an event from the joystick
-            JoystickEvent event;
+            controller.device = open_input_device(evdev_path->is_set() ? controller.path : "", controller.index);
+            if (!controller.device->is_open())
+            {
+                controller.device.reset();
+                return;
+            }
+
+            struct stat info;
+            controller.stream = stat(controller.path.c_str(), &info) == 0 && !S_ISCHR(info.st_mode);
+
+            // Regular files cannot be polled and are always readable
+            epoll_event event = {EPOLLIN, {}};
+            event.data.u64 = i;
+            controller.always_ready = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, controller.device->file_descriptor(), &event) < 0 && errno == EPERM;
+
+            // Start from a neutral stick with the initial speed limits
+            controller.input = InputState();
+            controller.input.connected = true;
+            controller.input.session = ++session;
+            controller.input.max_move_speed = initial_max_move_speed->value();
+            controller.input.max_turn_speed = initial_max_turn_speed->value();
+            controller.input.time_us = rc::monotonic_us();
+            std::fill(std::begin(controller.axis_updated), std::end(controller.axis_updated), false);
+            controller.speed_changed = false;
+            controller.pressed_count = 0;
+
+            controller.shared_input.store(controller.input);
+            signal_input();
 
-            if (!joystick.sample(&event))
+            joysticks_connected.set(++connected);
+            printf("Joystick %u connected: %s -> %s\n", controller.index, controller.path.c_str(), controller.key.c_str());
+        };
+
+        auto detach = [&](Controller &controller)
+        {
+            if (!controller.device)
             {
-                continue;
+                return;
+            }
+
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, controller.device->file_descriptor(), nullptr);
+            controller.device.reset();
+
+            controller.input = InputState();
+            controller.shared_input.store(controller.input);
+            signal_input();
+
+            joysticks_connected.set(--connected);
+            printf("Joystick %u disconnected\n", controller.index);
+        };
+
+        for (unsigned int i = 0; i < controllers.size(); i++)
+        {
+            if (!watcher.watch(controllers[i].path, i))
+            {
+                std::cerr << "Cannot watch " << controllers[i].path << ", hotplug disabled" << std::endl;
             }
+            attach(i);
+        }
+
+        if (connected == 0)
+        {
+            printf("Waiting for joystick\n");
+        }
+
+        // Events read per call, the kernel js queue holds 64 events
+        InputEvent events[64];
+        epoll_event ready[16];
+
+        auto read_reports = [&](Controller &controller)
+        {
+            if (!controller.device)
+            {
+                return;
+            }
+
+            // Drain all complete reports
+            int count;
+            while ((count = controller.device->read(events, 64)) > 0)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    InputEvent &event = events[i];
+                    InputState &input = controller.input;
+
+                    // Coalesce axis updates, only the latest value matters
+                    if (event.type == InputEventType::AXIS)
+                    {
+                        controller.axis_values[event.number] = event.value;
+                        controller.axis_updated[event.number] = true;
+                        joystick_events.inc();
+                        continue;
+                    }
+
+                    // Button presses
+                    if (event.type == InputEventType::BUTTON)
+                    {
+                        joystick_events.inc();
+
+                        if (event.value != 1) {
+                            continue;
+                        }
+
+                        if (event.number == inc_speed_button->value()) {
+                            input.max_move_speed *= 1.5;
+                            input.max_turn_speed *= 1.5;
+                            controller.speed_changed = true;
+                        } else if (event.number == dec_speed_button->value()) {
+                            input.max_move_speed /= 1.5;
+                            input.max_turn_speed /= 1.5;
+                            controller.speed_changed = true;
+                        } else if (event.number == reset_speed_button->value()) {
+                            input.max_move_speed = initial_max_move_speed->value();
+                            input.max_turn_speed = initial_max_turn_speed->value();
+                            controller.speed_changed = true;
+                        } else if (controller.pressed_count < 64) {
+                            controller.pressed_buttons[controller.pressed_count++] = event.number;
+                        }
+                        continue;
+                    }
 
-            mtx.lock();
-
-            // Button presses
-            if (event.isButton() && event.value == 1) {
-                if (event.number == inc_speed_button->value()) {
-                    max_move_speed *= 1.5;
-                    max_turn_speed *= 1.5;
-                    printf("Speed multiplier: %f\n", max_move_speed / initial_max_move_speed->value());
-                } else if (event.number == dec_speed_button->value()) {
-                    max_move_speed /= 1.5;
-                    max_turn_speed /= 1.5;
-                    printf("Speed multiplier: %f\n", max_move_speed / initial_max_move_speed->value());
-                } else if (event.number == reset_speed_button->value()) {
-                    max_move_speed = initial_max_move_speed->value();
-                    max_turn_speed = initial_max_turn_speed->value();
-                    printf("Speed multiplier: %f\n", max_move_speed / initial_max_move_speed->value());
-                } else {
-                    // log unknown button presses
-                    printf("Button %u pressed\n", event.number);
+                    // End of report, publish the complete state at once
+
+                    // Check move x-axis
+                    if (move_x_axis->value() < 256 && controller.axis_updated[move_x_axis->value()])
+                    {
+                        input.move_x = move_x_shaper.shape(controller.axis_values[move_x_axis->value()]);
+                    }
+
+                    // Check move y-axis
+                    if (move_y_axis->value() < 256 && controller.axis_updated[move_y_axis->value()])
+                    {
+                        input.move_y = move_y_shaper.shape(controller.axis_values[move_y_axis->value()]);
+                    }
+
+                    // Check turn axis
+                    if (turn_axis->value() < 256 && controller.axis_updated[turn_axis->value()])
+                    {
+                        input.turn = turn_shaper.shape(controller.axis_values[turn_axis->value()]);
+                    }
+
+                    input.time_us = event.time_us;
+                    controller.shared_input.store(input);
+                    input_reports.inc();
+
+                    if (policy_config.on_change)
+                    {
+                        signal_input();
+                    }
+
+                    // Log after the new state is visible to the publishing loop
+                    if (controller.speed_changed)
+                    {
+                        printf("Joystick %u speed multiplier: %f\n", controller.index, input.max_move_speed / initial_max_move_speed->value());
+                    }
+                    for (int j = 0; j < controller.pressed_count; j++)
+                    {
+                        // log unknown button presses
+                        printf("Joystick %u button %u pressed\n", controller.index, controller.pressed_buttons[j]);
+                    }
+
+                    std::fill(std::begin(controller.axis_updated), std::end(controller.axis_updated), false);
+                    controller.speed_changed = false;
+                    controller.pressed_count = 0;
                 }
             }
 
-            // Check move x-axis
-            if (event.isAxis() && event.number == move_x_axis->value())
+            if (count < 0)
             {
-                move_x_input = event.value / 32767.0;
+                if (controller.stream)
+                {
+                    // End of a recorded event stream
+                    printf("End of input stream\n");
+                    interrupted = true;
+                    return;
+                }
+                detach(controller);
             }
+        };
 
-            // Check move y-axis
-            if (event.isAxis() && event.number == move_y_axis->value())
+        while (!interrupted)
+        {
+            // Wait for events, wake up regularly to notice interrupts
+            bool always_ready = std::any_of(controllers.begin(), controllers.end(), [](const Controller &controller)
+                                            { return controller.device && controller.always_ready; });
+            int ready_count = epoll_wait(epoll_fd, ready, 16, always_ready ? 0 : 100);
+
+            for (int r = 0; r < ready_count; r++)
             {
-                move_y_input = -event.value / 32767.0;
+                if (ready[r].data.u64 == controllers.size())
+                {
+                    watcher.read([&](unsigned int id, bool present)
+                                 {
+                        if (present)
+                        {
+                            attach(id);
+                        }
+                        else
+                        {
+                            detach(controllers[id]);
+                        } });
+                    continue;
+                }
+
+                read_reports(controllers[ready[r].data.u64]);
             }
 
-            // Check turn axis
-            if (event.isAxis() && event.number == turn_axis->value())
+            for (auto &controller : controllers)
             {
-                turn_input = -event.value / 32767.0;
+                if (controller.device && controller.always_ready)
+                {
+                    read_reports(controller);
+                }
             }
+        }
 
-            mtx.unlock();
-        } });
+        for (auto &controller : controllers)
+        {
+            controller.device.reset();
+        }
+        close(epoll_fd); });
 
     // Publish speeds on main thread
-    std::vector<uint8_t> speeds_message(12);
-
     while (!interrupted)
     {
-        usleep(10000); // 10ms
+        // Sleep until the next publication is due, wake up early on input
+        // in on-change mode and on joystick attach and detach
+        uint64_t now_us = rc::monotonic_us();
+        uint64_t wait_us = 100000;
+
+        for (auto &controller : controllers)
+        {
+            if (controller.output)
+            {
+                uint64_t due_us = controller.output->policy.next_check_us();
+                wait_us = std::min(wait_us, due_us > now_us ? due_us - now_us : 0);
 
-        mtx.lock();
-        float move_x_speed = move_x_input * max_move_speed;
-        float move_y_speed = move_y_input * max_move_speed;
-        float turn_speed = turn_input * max_turn_speed;
-        memcpy(speeds_message.data(), &move_x_speed, 4);
-        memcpy(speeds_message.data() + 4, &move_y_speed, 4);
-        memcpy(speeds_message.data() + 8, &turn_speed, 4);
-        mtx.unlock();
+                // Keep updating while filtered axes are still moving
+                if (controller.output->filters_settling)
+                {
+                    wait_us = std::min(wait_us, policy_config.period_us);
+                }
+            }
+        }
+
+        pollfd pfd = {input_event, POLLIN, 0};
+        timespec timeout = {static_cast<time_t>(wait_us / 1000000), static_cast<long>(wait_us % 1000000) * 1000};
+        if (ppoll(&pfd, 1, &timeout, nullptr) > 0)
+        {
+            uint64_t count;
+            if (read(input_event, &count, sizeof(count)) < 0)
+            {
+                continue;
+            }
+        }
+
+        now_us = rc::monotonic_us();
+
+        for (auto &controller : controllers)
+        {
+            InputState input = controller.shared_input.load();
+
+            if (!input.connected)
+            {
+                // Stop the robot once when its joystick goes away
+                if (controller.output)
+                {
+                    controller.output.reset();
+                    controller.publisher.publish(rc::Command(), controller.sequence++, now_us, controller.flags);
+                    messages_published.inc();
+                }
+                continue;
+            }
+
+            // New session after (re)connecting
+            if (!controller.output || controller.output->session != input.session)
+            {
+                controller.output.reset(new ControllerOutput(input.session, policy_config, move_x_config.cutoff_hz,
+                                                             move_y_config.cutoff_hz, turn_config.cutoff_hz));
+                controller.flags = rc::FLAG_SESSION_START;
+            }
+
+            ControllerOutput &output = *controller.output;
 
-        zenoh_publisher.put(speeds_message);
+            rc::Command command;
+            command.move_x = output.move_x_filter.update(input.move_x, now_us) * input.max_move_speed;
+            command.move_y = output.move_y_filter.update(input.move_y, now_us) * input.max_move_speed;
+            command.turn = output.turn_filter.update(input.turn, now_us) * input.max_turn_speed;
+            output.filters_settling = output.move_x_filter.settling(input.move_x) || output.move_y_filter.settling(input.move_y) || output.turn_filter.settling(input.turn);
+
+            if (!output.policy.should_publish(command, now_us))
+            {
+                continue;
+            }
+
+            controller.publisher.publish(command, controller.sequence++, now_us, controller.flags);
+            controller.flags = 0;
+
+            messages_published.inc();
+
+            if (output.policy.published(command, now_us))
+            {
+                heartbeats_published.inc();
+            }
+            else
+            {
+                input_latency.observe(now_us - std::min(now_us, input.time_us));
+            }
+
+            if (output.last_publish_us > 0)
+            {
+                uint64_t interval_us = now_us - output.last_publish_us;
+                loop_period.observe(interval_us);
+                if (!policy_config.on_change)
+                {
+                    loop_jitter.observe(interval_us > policy_config.period_us ? interval_us - policy_config.period_us : policy_config.period_us - interval_us);
+                }
+            }
+            output.last_publish_us = now_us;
+        }
     }
 
     // Wait for joystick thread to finish
     joystick_thread.join();
 
     // Publish 0 speeds on exit
-    speeds_message.assign(12, 0);
-    zenoh_publisher.put(speeds_message);
+    for (auto &controller : controllers)
+    {
+        if (!controller.output)
+        {
+            continue;
+        }
+        controller.publisher.publish(rc::Command(), controller.sequence++, rc::monotonic_us());
+    }
+
+    close(input_event);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <signal.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <popl.hpp>
+#include <zenoh.hxx>
+#include <command_frame.h>
+#include "frame_publisher.h"
+
+// Publishes synthetic command messages to stress the subscriber: several
+// keys, configurable rates, bursts, jitter, duplicates and malformed
+// messages. With the subscriber's --echo-key set, echoed messages report
+// the subscriber's verdict and, for versioned frames, the round trip time.
+
+// Heap allocations made by the publishing thread, to check what the
+// publish path allocates per message. zenoh allocates with malloc, not
+// operator new, so malloc itself is interposed and forwarded to glibc.
+static thread_local uint64_t thread_allocations = 0;
+
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+
+    void *malloc(size_t size)
+    {
+        thread_allocations++;
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size)
+    {
+        thread_allocations++;
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *pointer, size_t size)
+    {
+        thread_allocations++;
+        return __libc_realloc(pointer, size);
+    }
+
+    int posix_memalign(void **pointer, size_t alignment, size_t size)
+    {
+        thread_allocations++;
+        *pointer = __libc_memalign(alignment, size);
+        return *pointer || !size ? 0 : ENOMEM;
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size)
+    {
+        thread_allocations++;
+        return __libc_memalign(alignment, size);
+    }
+}
+
+bool interrupted = false;
+
+void interrupt_handler(int)
+{
+    interrupted = true;
+}
+
+// Publishing and echo state of one key
+struct Target
+{
+    Target(zenoh::Session &session, std::string key, rc::FrameFormat format, bool shared_memory)
+        : key(key), publisher(session, key, format, shared_memory)
+    {
+    }
+
+    std::string key;
+    FramePublisher publisher;
+    uint64_t next_us = 0;
+    uint32_t sequence = 0;
+    uint8_t flags = rc::FLAG_SESSION_START;
+
+    uint64_t sent = 0;
+    uint64_t duplicates = 0;
+    uint64_t malformed = 0;
+};
+
+struct EchoStats
+{
+    std::mutex mtx;
+    uint64_t received[4] = {};
+    std::vector<uint64_t> rtt_us;
+};
+
+static void sleep_until_us(uint64_t time_us)
+{
+    timespec deadline = {static_cast<time_t>(time_us / 1000000), static_cast<long>(time_us % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR && !interrupted)
+    {
+    }
+}
+
+static uint64_t percentile(std::vector<uint64_t> &values, double q)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(q * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static std::string substitute(std::string text, const std::string &name, const std::string &value)
+{
+    size_t position = text.find(name);
+    if (position != std::string::npos)
+    {
+        text.replace(position, name.size(), value);
+    }
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    // Register interrupt handler
+    struct sigaction sig_int_handler;
+    sig_int_handler.sa_handler = interrupt_handler;
+    sigemptyset(&sig_int_handler.sa_mask);
+    sig_int_handler.sa_flags = 0;
+    sigaction(SIGINT, &sig_int_handler, NULL);
+
+    // Parse arguments
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto key = op.add<popl::Value<std::string>>("", "key", "zenoh key, {n} is replaced by the key number", "rc/{n}");
+    auto keys = op.add<popl::Value<unsigned int>>("k", "keys", "number of keys to publish on", 1);
+    auto format = op.add<popl::Value<std::string>>("", "format", "message format: legacy, float or fixed", "float");
+    auto rate = op.add<popl::Value<float>>("", "rate", "bursts per second per key", 100);
+    auto burst = op.add<popl::Value<unsigned int>>("", "burst", "messages published back to back per burst", 1);
+    auto jitter = op.add<popl::Value<unsigned int>>("", "jitter", "random extra delay before each burst, up to this value (us)", 0);
+    auto duplicates = op.add<popl::Value<float>>("", "duplicates", "probability of publishing a message twice", 0);
+    auto malformed = op.add<popl::Value<float>>("", "malformed", "probability of publishing a message with an invalid length", 0);
+    auto move_speed = op.add<popl::Value<float>>("", "move-speed", "amplitude of the generated moving speed (m/s)", 0.2);
+    auto turn_speed = op.add<popl::Value<float>>("", "turn-speed", "amplitude of the generated turning speed (rad/s)", 0.5);
+    auto duration = op.add<popl::Value<float>>("t", "duration", "run time (s)", 10);
+    auto echo_key = op.add<popl::Value<std::string>>("", "echo-key", "subscriber echo key to measure delivery, {key} is replaced by the command key");
+    auto seed = op.add<popl::Value<unsigned int>>("", "seed", "random seed", 1);
+    auto shared_memory = op.add<popl::Switch>("", "shm", "publish from zenoh shared memory, if built with it");
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    rc::FrameFormat frame_format;
+
+    if (format->value() == "legacy")
+    {
+        frame_format = rc::FrameFormat::LEGACY;
+    }
+    else if (format->value() == "float")
+    {
+        frame_format = rc::FrameFormat::FLOAT;
+    }
+    else if (format->value() == "fixed")
+    {
+        frame_format = rc::FrameFormat::FIXED;
+    }
+    else
+    {
+        std::cerr << "Unknown message format: " << format->value() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (rate->value() <= 0.0f)
+    {
+        std::cerr << "Rate must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Start zenoh session
+    zenoh::Config zenoh_config;
+    zenoh_config.insert_json(Z_CONFIG_MODE_KEY, "\"peer\"");
+    auto zenoh_session = zenoh::expect(zenoh::open(std::move(zenoh_config)));
+
+    // Publishers hold their buffers, so keep them in place
+    std::deque<Target> targets;
+
+    for (unsigned int i = 0; i < std::max(1u, keys->value()); i++)
+    {
+        targets.emplace_back(zenoh_session, substitute(key->value(), "{n}", std::to_string(i)), frame_format, shared_memory->is_set());
+    }
+
+    if (shared_memory->is_set() && !targets.front().publisher.shared_memory())
+    {
+        std::cerr << "Shared memory not available, publishing from a copy" << std::endl;
+    }
+
+    // Collect echoes from the subscribers
+    EchoStats echo_stats;
+    std::vector<zenoh::Subscriber> echo_subscribers;
+
+    if (echo_key->is_set())
+    {
+        for (const Target &target : targets)
+        {
+            std::string target_echo_key = substitute(echo_key->value(), "{key}", target.key);
+            echo_subscribers.push_back(zenoh::expect(zenoh_session.declare_subscriber(target_echo_key, [&](const zenoh::Sample &sample)
+                                                                                      {
+                uint64_t now_us = rc::monotonic_us();
+
+                if (sample.payload.len < 1)
+                {
+                    return;
+                }
+
+                uint8_t status = sample.payload.start[sample.payload.len - 1];
+                rc::Command command;
+                rc::FrameHeader header;
+                bool timed = rc::decode_frame(sample.payload.start, sample.payload.len - 1, &command, &header) && header.version > 0;
+
+                std::lock_guard<std::mutex> lock(echo_stats.mtx);
+                if (status < 4)
+                {
+                    echo_stats.received[status]++;
+                }
+
+                // Same host, so the sender timestamp is on this clock
+                if (timed && status == rc::ECHO_ACCEPTED)
+                {
+                    echo_stats.rtt_us.push_back(now_us - header.timestamp_us);
+                } })));
+        }
+    }
+
+    printf("Publishing on %zu key(s) for %.1f s, press Ctrl+C to stop\n", targets.size(), duration->value());
+
+    std::mt19937 random(seed->value());
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+    std::uniform_int_distribution<unsigned int> jitter_us(0, jitter->value());
+    std::uniform_int_distribution<size_t> malformed_size(1, 40);
+    std::uniform_int_distribution<int> malformed_byte(0, 255);
+
+    const uint64_t period_us = 1e6 / rate->value();
+    const uint64_t start_us = rc::monotonic_us();
+    const uint64_t end_us = start_us + duration->value() * 1e6;
+    uint64_t lateness_max_us = 0;
+    uint64_t lateness_sum_us = 0;
+    uint64_t bursts = 0;
+
+    // Spread the keys over the period
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        targets[i].next_us = start_us + period_us * i / targets.size();
+    }
+
+    std::vector<uint8_t> bad_message;
+    uint64_t publish_allocations = 0;
+
+    while (!interrupted)
+    {
+        Target &target = *std::min_element(targets.begin(), targets.end(), [](const Target &a, const Target &b)
+                                           { return a.next_us < b.next_us; });
+
+        uint64_t due_us = target.next_us + jitter_us(random);
+        if (due_us >= end_us)
+        {
+            break;
+        }
+
+        sleep_until_us(due_us);
+
+        uint64_t now_us = rc::monotonic_us();
+        lateness_max_us = std::max(lateness_max_us, now_us - std::min(now_us, due_us));
+        lateness_sum_us += now_us - std::min(now_us, due_us);
+        bursts++;
+
+        for (unsigned int i = 0; i < std::max(1u, burst->value()); i++)
+        {
+            if (malformed->value() > 0.0f && chance(random) < malformed->value())
+            {
+                size_t size;
+                do
+                {
+                    size = malformed_size(random);
+                } while (size == rc::frame_size(rc::FrameFormat::LEGACY) || size == rc::frame_size(rc::FrameFormat::FLOAT) ||
+                         size == rc::frame_size(rc::FrameFormat::FIXED));
+
+                bad_message.resize(size);
+                for (auto &byte : bad_message)
+                {
+                    byte = malformed_byte(random);
+                }
+                target.publisher.publish_raw(bad_message);
+                target.malformed++;
+                continue;
+            }
+
+            // Slowly varying speeds, so every message differs
+            double t = (now_us - start_us) * 1e-6;
+            rc::Command command;
+            command.move_y = move_speed->value() * std::sin(t);
+            command.turn = turn_speed->value() * std::sin(0.37 * t);
+
+            uint32_t sequence = target.sequence++;
+            uint64_t timestamp_us = rc::monotonic_us();
+            uint64_t allocations = thread_allocations;
+
+            target.publisher.publish(command, sequence, timestamp_us, target.flags);
+            publish_allocations += thread_allocations - allocations;
+            target.sent++;
+
+            if (duplicates->value() > 0.0f && chance(random) < duplicates->value())
+            {
+                target.publisher.publish(command, sequence, timestamp_us, target.flags);
+                target.duplicates++;
+            }
+            target.flags = 0;
+        }
+
+        target.next_us += period_us;
+    }
+
+    double elapsed_s = (rc::monotonic_us() - start_us) / 1e6;
+
+    // Give the last echoes time to arrive
+    if (echo_key->is_set())
+    {
+        sleep_until_us(rc::monotonic_us() + 200000);
+    }
+
+    uint64_t sent = 0, duplicate_count = 0, malformed_count = 0, shm_fallbacks = 0;
+    for (const Target &target : targets)
+    {
+        sent += target.sent;
+        duplicate_count += target.duplicates;
+        malformed_count += target.malformed;
+        shm_fallbacks += target.publisher.shm_fallbacks();
+    }
+
+    printf("Published %lu commands, %lu duplicates, %lu malformed in %.2f s (%.0f messages/s)\n", (unsigned long)sent,
+           (unsigned long)duplicate_count, (unsigned long)malformed_count, elapsed_s,
+           (sent + duplicate_count + malformed_count) / std::max(elapsed_s, 1e-9));
+    printf("Burst start lateness: mean %.1f us, max %lu us\n", bursts ? (double)lateness_sum_us / bursts : 0.0,
+           (unsigned long)lateness_max_us);
+    // Counted at malloc level, so this includes zenoh's own allocations,
+    // e.g. the payload copy put() makes of every copied frame
+    printf("Publish path: %.2f heap allocations per command, zenoh included, %s", sent ? (double)publish_allocations / sent : 0.0,
+           targets.front().publisher.shared_memory() ? "shared memory" : "payload copied by zenoh");
+    if (targets.front().publisher.shared_memory())
+    {
+        printf(", %lu copied after running out of shared memory", (unsigned long)shm_fallbacks);
+    }
+    printf("\n");
+
+    if (echo_key->is_set())
+    {
+        std::lock_guard<std::mutex> lock(echo_stats.mtx);
+        uint64_t echoed = echo_stats.received[0] + echo_stats.received[1] + echo_stats.received[2] + echo_stats.received[3];
+
+        printf("Echoed %lu of %lu messages: %lu accepted, %lu malformed, %lu out of order, %lu stale\n", (unsigned long)echoed,
+               (unsigned long)(sent + duplicate_count + malformed_count), (unsigned long)echo_stats.received[rc::ECHO_ACCEPTED],
+               (unsigned long)echo_stats.received[rc::ECHO_MALFORMED], (unsigned long)echo_stats.received[rc::ECHO_OUT_OF_ORDER],
+               (unsigned long)echo_stats.received[rc::ECHO_STALE]);
+
+        if (!echo_stats.rtt_us.empty())
+        {
+            uint64_t max_us = *std::max_element(echo_stats.rtt_us.begin(), echo_stats.rtt_us.end());
+            printf("Round trip: p50 %lu us, p99 %lu us, max %lu us\n", (unsigned long)percentile(echo_stats.rtt_us, 0.50),
+                   (unsigned long)percentile(echo_stats.rtt_us, 0.99), (unsigned long)max_us);
+        }
+        else if (frame_format == rc::FrameFormat::LEGACY)
+        {
+            printf("Round trip times need a versioned --format\n");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
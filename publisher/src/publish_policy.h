@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <command_frame.h>
+
+// Decides when the publisher sends a command.
+//
+// Periodic mode publishes every period_us. On-change mode publishes as
+// soon as a command differs from the last published one by more than the
+// deadband (or starts/stops moving), but never more often than
+// min_interval_us. While the command does not change, it publishes a
+// heartbeat whose interval starts at min_heartbeat_us after a change and
+// doubles up to max_heartbeat_us, which must stay below the subscriber's
+// kill timeout.
+class PublishPolicy
+{
+public:
+    struct Config
+    {
+        bool on_change = false;
+        uint64_t period_us = 10000;
+        uint64_t min_interval_us = 5000;
+        uint64_t min_heartbeat_us = 20000;
+        uint64_t max_heartbeat_us = 100000;
+        float deadband = 0.005f;
+    };
+
+    explicit PublishPolicy(const Config &config)
+        : config_(config), heartbeat_us_(config.min_heartbeat_us)
+    {
+    }
+
+    bool on_change() const { return config_.on_change; }
+
+    // Latest time to check again, earlier wakeups on input are fine
+    uint64_t next_check_us() const
+    {
+        if (!published_)
+        {
+            return 0;
+        }
+        if (!config_.on_change)
+        {
+            return last_publish_us_ + config_.period_us;
+        }
+        return last_publish_us_ + (pending_ ? config_.min_interval_us : heartbeat_us_);
+    }
+
+    // Returns true if command should be published now. The caller must
+    // then call published().
+    bool should_publish(const rc::Command &command, uint64_t now_us)
+    {
+        if (!published_)
+        {
+            return true;
+        }
+
+        uint64_t elapsed_us = now_us - last_publish_us_;
+
+        if (!config_.on_change)
+        {
+            return elapsed_us >= config_.period_us;
+        }
+
+        if (changed(command))
+        {
+            pending_ = elapsed_us < config_.min_interval_us;
+            return !pending_;
+        }
+
+        pending_ = false;
+        return elapsed_us >= heartbeat_us_;
+    }
+
+    // Returns true if this publication was a heartbeat, not a change
+    bool published(const rc::Command &command, uint64_t now_us)
+    {
+        bool heartbeat = published_ && config_.on_change && !changed(command);
+
+        if (heartbeat)
+        {
+            heartbeat_us_ = std::min(heartbeat_us_ * 2, config_.max_heartbeat_us);
+        }
+        else
+        {
+            heartbeat_us_ = config_.min_heartbeat_us;
+        }
+
+        published_ = true;
+        pending_ = false;
+        last_command_ = command;
+        last_publish_us_ = now_us;
+        return heartbeat;
+    }
+
+private:
+    static bool moving(const rc::Command &command)
+    {
+        return command.move_x != 0.0f || command.move_y != 0.0f || command.turn != 0.0f;
+    }
+
+    bool changed(const rc::Command &command) const
+    {
+        return moving(command) != moving(last_command_) ||
+               std::abs(command.move_x - last_command_.move_x) > config_.deadband ||
+               std::abs(command.move_y - last_command_.move_y) > config_.deadband ||
+               std::abs(command.turn - last_command_.turn) > config_.deadband;
+    }
+
+    const Config config_;
+    bool published_ = false;
+    bool pending_ = false;
+    uint64_t heartbeat_us_;
+    uint64_t last_publish_us_ = 0;
+    rc::Command last_command_;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+// Tracks late motor cycles. After `after` consecutive late cycles the
+// motors are degraded, i.e. kept stopped, until as many consecutive cycles
+// are on time again. Late cycles only count once armed, which the motors
+// thread does after the scheduler has fitted the period to the first
+// window of cycles.
+class DegradedMode
+{
+public:
+    explicit DegradedMode(unsigned int after) : after_(after) {}
+
+    bool degraded() const { return degraded_; }
+    unsigned int late_in_row() const { return late_in_row_; }
+    unsigned int on_time_in_row() const { return on_time_in_row_; }
+
+    // Call at the end of every cycle. Returns true if degraded mode was
+    // entered or left.
+    bool update(bool on_time, bool armed)
+    {
+        if (on_time)
+        {
+            late_in_row_ = 0;
+            on_time_in_row_++;
+        }
+        else
+        {
+            if (armed)
+            {
+                late_in_row_++;
+            }
+            on_time_in_row_ = 0;
+        }
+
+        if (!degraded_ && late_in_row_ >= after_)
+        {
+            degraded_ = true;
+            return true;
+        }
+        if (degraded_ && on_time_in_row_ >= after_)
+        {
+            degraded_ = false;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    const unsigned int after_;
+    bool degraded_ = false;
+    unsigned int late_in_row_ = 0;
+    unsigned int on_time_in_row_ = 0;
+};
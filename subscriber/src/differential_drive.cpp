@@ -1,11 +1,28 @@
 #include <signal.h>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <cmath>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <MoteusAPI.h>
+#include <FdcanusbTransport.h>
+#include <SocketCanTransport.h>
 #include <popl.hpp>
 #include <zenoh.hxx>
+#include <command_frame.h>
+#include <motor_health.h>
+#include <metrics.h>
+#include "degraded_mode.h"
+#include "drive_controller.h"
+#include "flight_recorder.h"
+#include "motor_backend.h"
+#include "motor_discovery.h"
+#include "sim_motor.h"
+#include "rate_scheduler.h"
 
 bool interrupted = false;
 
@@ -14,6 +31,55 @@ void interrupt_handler(int)
     interrupted = true;
 }
 
+std::vector<std::string> split_list(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');)
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Queries health and telemetry registers of a motor, fields stay NAN if
+// the motor does not reply
+State read_motor_state(MotorGroup &motors, size_t i)
+{
+    State state;
+    state.EN_Position().EN_Velocity().EN_Torque().EN_Voltage().EN_Temp().EN_Fault().EN_Mode();
+    motors.ReadState(i, state);
+    return state;
+}
+
+rc::MotorHealth to_motor_health(unsigned int id, const State &state)
+{
+    rc::MotorHealth health;
+    health.id = id;
+    health.flags = std::isnan(state.voltage) ? 0 : rc::HEALTH_VALID;
+    health.mode = std::isnan(state.mode) ? 0 : static_cast<uint8_t>(state.mode);
+    health.fault = std::isnan(state.fault) ? 0 : static_cast<uint8_t>(state.fault);
+    health.voltage = state.voltage;
+    health.temperature = state.temperature;
+    return health;
+}
+
+MotorTelemetry to_motor_telemetry(const State &state)
+{
+    MotorTelemetry telemetry;
+    telemetry.position = state.position;
+    telemetry.velocity = state.velocity;
+    telemetry.torque = state.torque;
+    telemetry.voltage = state.voltage;
+    telemetry.temperature = state.temperature;
+    telemetry.fault = std::isnan(state.fault) ? -1 : static_cast<int16_t>(state.fault);
+    telemetry.mode = std::isnan(state.mode) ? -1 : static_cast<int16_t>(state.mode);
+    return telemetry;
+}
+
 int main(int argc, char *argv[])
 {
     // Register interrupt handler
@@ -26,10 +92,16 @@ int main(int argc, char *argv[])
     // Parse arguments
     popl::OptionParser op("Allowed options");
     auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto verbose = op.add<popl::Switch>("v", "verbose", "print the wheel speeds, at most every 100 ms");
     auto key = op.add<popl::Value<std::string>>("", "key", "zenoh key", "rc/0");
     auto r = op.add<popl::Value<float>>("r", "wheel-radius", "wheel radius (m) for differential drive calculation", 0.08);
     auto b = op.add<popl::Value<float>>("b", "vehicle-width", "distance between wheels (m) for differential drive calculation", 0.31);
-    auto device = op.add<popl::Value<std::string>>("d", "device", "device path", "/dev/ttyACM0");
+    auto device = op.add<popl::Value<std::string>>("d", "device", "device path, or CAN interface for socketcan, comma separated for one adapter per motor", "/dev/ttyACM0");
+    auto discover = op.add<popl::Switch>("", "discover", "find the adapters of the motors on /dev/ttyACM* instead of --device");
+    auto topology_cache = op.add<popl::Value<std::string>>("", "topology-cache", "adapter topology cache for --discover, empty to always probe", "motor_topology.txt");
+    auto discover_ids = op.add<popl::Value<unsigned int>>("", "discover-ids", "moteus IDs 1 to this are probed by --discover", 8);
+    auto discover_timeout = op.add<popl::Value<unsigned int>>("", "discover-timeout", "time to wait for motor replies when probing an adapter (ms)", 50);
+    auto backend = op.add<popl::Value<std::string>>("", "backend", "motor backend: moteus, socketcan or sim", "moteus");
     auto max_move_speed = op.add<popl::Value<float>>("", "max-move-speed", "max moving speed (m/s)", 1.0);
     auto max_turn_speed = op.add<popl::Value<float>>("", "max-turn-speed", "max turning speed (rad/s)", 2.0);
     auto left_motor_id = op.add<popl::Value<unsigned int>>("", "left-motor-id", "left motor ID", 1);
@@ -40,7 +112,26 @@ int main(int argc, char *argv[])
     auto feedforward_torque = op.add<popl::Value<float>>("", "feedforward-torque", "Moteus feedforward_torque", 0.0);
     auto kp_scale = op.add<popl::Value<float>>("", "kp-scale", "Moteus kp_scale", 4.0);
     auto kd_scale = op.add<popl::Value<float>>("", "kd-scale", "Moteus kd_scale", 4.0);
+    auto max_command_age = op.add<popl::Value<unsigned int>>("", "max-command-age", "drop commands delayed more than this in transit (ms), 0 to disable", 100);
     auto motor_speed_multiplier = op.add<popl::Value<float>>("m", "--motor-speed-multiplier", "Multipler to convert wheel rotation speed to motor speed value", 0.67);
+    auto recorder_path = op.add<popl::Value<std::string>>("", "recorder-path", "flight recorder ring file, empty to disable", "flight_recorder.bin");
+    auto recorder_records = op.add<popl::Value<unsigned int>>("", "recorder-records", "flight recorder capacity (records of 96 bytes)", 262144);
+    auto health_key = op.add<popl::Value<std::string>>("", "health-key", "zenoh key for motor health", "{key}/health");
+    auto echo_key = op.add<popl::Value<std::string>>("", "echo-key", "echo received commands on this key for load tests, empty to disable", "");
+    auto health_rate = op.add<popl::Value<float>>("", "health-rate", "motor health sampling rate (Hz), 0 to disable", 1.0);
+    auto control_period = op.add<popl::Value<unsigned int>>("", "control-period", "target motor control period (us)", 1000);
+    auto max_control_period = op.add<popl::Value<unsigned int>>("", "max-control-period", "slowest motor control period when saturated (us)", 20000);
+    auto headroom = op.add<popl::Value<float>>("", "headroom", "fraction of the control period kept free", 0.25);
+    auto cycle_deadline = op.add<popl::Value<unsigned int>>("", "cycle-deadline", "abandon motor cycles after this time (us), 0 for the control period", 0);
+    auto degraded_after = op.add<popl::Value<unsigned int>>("", "degraded-after", "stop the motors after this many consecutive late cycles, until as many are on time", 3);
+    auto bus_threads = op.add<popl::Switch>("", "bus-threads", "serve each adapter from its own I/O thread");
+    auto bus_cpus = op.add<popl::Value<std::string>>("", "bus-cpus", "comma separated CPUs to pin the adapter I/O threads to", "");
+    auto nominal_bitrate = op.add<popl::Value<unsigned int>>("", "nominal-bitrate", "CAN nominal bitrate of the motor buses (bit/s)", 1000000);
+    auto data_bitrate = op.add<popl::Value<unsigned int>>("", "data-bitrate", "CAN-FD data bitrate of the motor buses (bit/s)", 5000000);
+    auto max_bus_utilization = op.add<popl::Value<float>>("", "max-bus-utilization", "raise the control period to keep the busiest motor bus below this fraction, 0 to disable", 0.8);
+    auto reply_interval = op.add<popl::Value<unsigned int>>("", "reply-interval", "request motor replies every this many cycles, 1 for every cycle", 1);
+    auto metrics_port = op.add<popl::Value<unsigned int>>("", "metrics-port", "serve Prometheus metrics on this HTTP port, 0 to disable", 0);
+    auto metrics_address = op.add<popl::Value<std::string>>("", "metrics-address", "metrics HTTP server address", "127.0.0.1");
 
     try
     {
@@ -60,86 +151,489 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Use mutex for move speed and turn speed
+    // Auto-generate health key if not set
+    if (!health_key->is_set())
+    {
+        health_key->set_value(key->value() + "/health");
+    }
+
+    DriveParams drive_params;
+    drive_params.wheel_radius = r->value();
+    drive_params.vehicle_width = b->value();
+    drive_params.max_move_speed = max_move_speed->value();
+    drive_params.max_turn_speed = max_turn_speed->value();
+    drive_params.stop_threshold = stop_threshold->value();
+    drive_params.motor_speed_multiplier = motor_speed_multiplier->value();
+    drive_params.kill_timeout_us = kill_timeout->value() * 1000;
+
+    // Metrics, updated lock-free from the control path
+    metrics::Registry registry;
+    auto &messages_received = registry.counter("rc_subscriber_messages_received_total", "Command messages received");
+    auto &messages_malformed = registry.counter("rc_subscriber_messages_malformed_total", "Command messages with unknown format");
+    auto &messages_out_of_order = registry.counter("rc_subscriber_messages_out_of_order_total", "Command messages dropped as out of order");
+    auto &messages_stale = registry.counter("rc_subscriber_messages_stale_total", "Command messages dropped as stale");
+    auto &cycles = registry.counter("rc_subscriber_cycles_total", "Motor control cycles");
+    auto &serial_timeouts = registry.counter("rc_subscriber_serial_timeouts_total", "Motor commands without reply");
+    auto &late_cycles = registry.counter("rc_subscriber_late_cycles_total", "Motor control cycles abandoned at their deadline");
+    auto &degraded_gauge = registry.gauge("rc_subscriber_degraded", "1 while the motors are stopped after late cycles");
+    auto &unreplied_commands = registry.counter("rc_subscriber_unreplied_commands_total", "Motor commands sent without requesting a reply");
+    auto &stop_events = registry.counter("rc_subscriber_stop_events_total", "Transitions from driving to stopped motors");
+    auto &loop_period = registry.histogram("rc_subscriber_loop_period_seconds", "Motor control cycle period", metrics::exponential_buckets(250, 1.5, 16));
+    auto &loop_jitter = registry.histogram("rc_subscriber_loop_jitter_seconds", "Lateness of the motor control cycle start", metrics::exponential_buckets(10, 2, 14));
+    auto &cycle_cost = registry.histogram("rc_subscriber_cycle_cost_seconds", "Motor control cycle duration", metrics::exponential_buckets(50, 1.5, 18));
+    auto &overruns = registry.counter("rc_subscriber_overruns_total", "Motor control cycles that ran past the next deadline");
+    auto &control_period_gauge = registry.gauge("rc_subscriber_control_period_seconds", "Scheduled motor control period");
+    auto &control_rate = registry.gauge("rc_subscriber_control_rate_hz", "Achieved motor control rate");
+    auto &telemetry_rate = registry.gauge("rc_subscriber_telemetry_rate_hz", "Motor health sampling rate");
+    auto &bus_utilization = registry.gauge("rc_subscriber_bus_utilization", "Fraction of the control period the busiest motor bus was busy in the last cycle");
+    auto &serial_rtt = registry.histogram("rc_subscriber_serial_rtt_seconds", "Round trip time of the motor commands of a cycle", metrics::exponential_buckets(50, 1.5, 18));
+
+    metrics::HttpServer metrics_server(registry);
+
+    if (metrics_port->value() > 0 && metrics_server.start(metrics_address->value(), metrics_port->value()))
+    {
+        printf("Metrics: http://%s:%u/metrics\n", metrics_address->value().c_str(), metrics_port->value());
+    }
+
+    // Use mutex for the controller, which holds move speed and turn speed
     std::mutex mtx;
-    float move_speed = 0.0;
-    float turn_speed = 0.0;
-    auto last_command_time = std::chrono::steady_clock::now();
-    const auto kill_duration = std::chrono::milliseconds(kill_timeout->value());
+    DriveController controller(drive_params);
+    rc::FrameFilter frame_filter(max_command_age->value() * 1000, kill_timeout->value() * 1000);
+
+    // Record commands and motor cycles for offline analysis
+    FlightRecorder recorder;
+
+    if (!recorder_path->value().empty() && !recorder.open(recorder_path->value(), recorder_records->value(), drive_params))
+    {
+        std::cerr << "Flight recorder disabled" << std::endl;
+    }
 
     // Send motor commands on separate thread
-    string dev_name(device->value());
-    MoteusAPI left_motor(dev_name, left_motor_id->value());
-    MoteusAPI right_motor(dev_name, right_motor_id->value());
+    // The left motor is motor 0, the right motor is motor 1
+    std::unique_ptr<SimulatedRobot> sim_robot;
+    std::unique_ptr<MotorGroup> motors_ptr;
+    std::vector<std::shared_ptr<MoteusTransport>> transports;
+    // Transport of each motor, taken round robin if there are fewer
+    std::vector<size_t> motor_transports = {0, 1};
+    CanBitrates bitrates;
+    bitrates.nominal = nominal_bitrate->value();
+    bitrates.data = data_bitrate->value();
+
+    if (backend->value() == "moteus")
+    {
+        std::vector<std::string> names;
+        if (discover->is_set())
+        {
+            std::vector<std::string> motor_devices;
+            if (!locate_motors({static_cast<int>(left_motor_id->value()), static_cast<int>(right_motor_id->value())}, topology_cache->value(),
+                               discover_ids->value(), discover_timeout->value() * 1000, motor_devices))
+            {
+                std::cerr << "Motors not found on any adapter" << std::endl;
+                return EXIT_FAILURE;
+            }
+            for (size_t i = 0; i < motor_devices.size(); i++)
+            {
+                auto name = std::find(names.begin(), names.end(), motor_devices[i]);
+                motor_transports[i] = name - names.begin();
+                if (name == names.end())
+                {
+                    names.push_back(motor_devices[i]);
+                }
+                printf("Motor %zu on %s\n", i, motor_devices[i].c_str());
+            }
+        }
+        else
+        {
+            names = split_list(device->value());
+        }
+
+        for (const std::string &name : names)
+        {
+            transports.push_back(std::make_shared<FdcanusbTransport>(name, bitrates));
+        }
+    }
+    else if (backend->value() == "socketcan")
+    {
+        for (const std::string &name : split_list(device->is_set() ? device->value() : "can0"))
+        {
+            SocketCanTransport::Options can_options;
+            can_options.interface = name;
+            can_options.bitrates = bitrates;
+            transports.push_back(std::make_shared<SocketCanTransport>(can_options));
+        }
+    }
+    else if (backend->value() == "sim")
+    {
+        // Simulated robot on the wall clock, for driving without hardware
+        sim_robot = std::make_unique<SimulatedRobot>(2, WheelModel(), rc::monotonic_us);
+        motors_ptr = std::make_unique<SimulatedMotorGroup>(*sim_robot);
+    }
+    else
+    {
+        std::cerr << "Unknown motor backend: " << backend->value() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!transports.empty())
+    {
+        // Motors share the adapter unless each has its own
+        std::vector<MoteusGroup::Servo> servos(2);
+        servos[0].transport = transports[motor_transports[0] % transports.size()];
+        servos[0].id = left_motor_id->value();
+        servos[1].transport = transports[motor_transports[1] % transports.size()];
+        servos[1].id = right_motor_id->value();
+
+        MoteusGroup::Options group_options;
+        group_options.bus_threads = bus_threads->is_set();
+        for (const std::string &cpu : split_list(bus_cpus->value()))
+        {
+            group_options.cpus.push_back(std::stoi(cpu));
+        }
+        motors_ptr = std::make_unique<MoteusMotorGroup>(servos, group_options);
+    }
+
+    MotorGroup &motors = *motors_ptr;
+    bool motor_ok[2];
+
+    // Admission control: a replied cycle of driving commands must fit the
+    // busiest bus within the utilization ceiling, otherwise the control
+    // period is raised, or the configuration refused if even the slowest
+    // period does not fit
+    unsigned int target_period_us = control_period->value();
+    unsigned int max_period_us = std::max(max_control_period->value(), control_period->value());
+    motors.SetPositionCommand(0, NAN, 0, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
+    motors.SetPositionCommand(1, NAN, 0, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
+    const double cycle_bus_time_us = motors.EstimateBusTimeUs();
+    if (cycle_bus_time_us > 0 && max_bus_utilization->value() > 0)
+    {
+        const unsigned int min_period_us = std::ceil(cycle_bus_time_us / max_bus_utilization->value());
+        if (min_period_us > max_period_us)
+        {
+            std::cerr << "Motor cycles need " << cycle_bus_time_us << " us of bus time, more than "
+                      << max_bus_utilization->value() * 100 << "% of the max control period" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (min_period_us > target_period_us)
+        {
+            printf("Control period raised to %u us, motor cycles need %.0f us of bus time\n", min_period_us, cycle_bus_time_us);
+            target_period_us = min_period_us;
+        }
+    }
 
     // Send stop command immediately when program is started
-    left_motor.SendStopCommand();
-    right_motor.SendStopCommand();
+    // Stop commands at startup and exit wait this long
+    const int64_t stop_timeout_us = 1000000;
+    motors.SetStopCommand(0);
+    motors.SetStopCommand(1);
+    motors.Cycle(true, stop_timeout_us, motor_ok);
+
+    // Latest motor health snapshot, sampled by the motors thread and
+    // published from the main thread
+    std::mutex health_mtx;
+    std::vector<uint8_t> health_message;
+    bool health_updated = false;
+    uint32_t health_sequence = 0;
+
+    // Adapt the control period to the measured cycle cost
+    RateScheduler::Config scheduler_config;
+    scheduler_config.target_period_us = target_period_us;
+    scheduler_config.max_period_us = max_period_us;
+    scheduler_config.telemetry_period_us = health_rate->value() > 0 ? 1e6 / health_rate->value() : 0;
+    scheduler_config.headroom = headroom->value();
+    RateScheduler scheduler(scheduler_config);
+
+    control_period_gauge.set(scheduler.period_us() * 1e-6);
+    telemetry_rate.set(health_rate->value());
 
     std::thread motors_thread([&]()
                               {
-                                  while (!interrupted)
-                                  {
-                                      usleep(1000); // 1ms
-
-                                      mtx.lock();
-
-                                        // Set speeds to 0 if no commands have been received recently
-                                      if (std::chrono::steady_clock::now() - last_command_time > kill_duration)
-                                      {
-                                        move_speed = 0;
-                                        turn_speed = 0;
-                                      }
-                                      
-                                    // Make sure max speeds are not exceeded
-                                    if (std::abs(move_speed) > max_move_speed->value()) {
-                                        move_speed = move_speed/std::abs(move_speed)*max_move_speed->value();
-                                    }
-
-                                    if (std::abs(turn_speed) > max_turn_speed->value()) {
-                                        turn_speed = turn_speed/std::abs(turn_speed)*max_turn_speed->value();
-                                    }
-
-                                      // Calculate wheel speeds based on r, b
-                                      if (std::abs(move_speed) < stop_threshold->value() && std::abs(turn_speed) < stop_threshold->value()) {
-                                        left_motor.SendStopCommand();
-                                        right_motor.SendStopCommand();
-                                      } else {
-                                        auto left_wheel_rot_speed = (move_speed - turn_speed * b->value()/2) / r->value();
-                                        auto right_wheel_rot_speed = (move_speed + turn_speed * b->value()/2) / r->value();
-
-                                        left_wheel_rot_speed *= motor_speed_multiplier->value();
-                                        right_wheel_rot_speed *= motor_speed_multiplier->value();
-
-                                        left_motor.SendPositionCommand(NAN, -left_wheel_rot_speed, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
-                                        right_motor.SendPositionCommand(NAN, right_wheel_rot_speed, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
-
-                                      printf("L: %f, R: %f\n", left_wheel_rot_speed, right_wheel_rot_speed);
-                                      }
-
-                                      mtx.unlock();
-                                  }
-
-                                  // Stop motors on interrupt
-                                  left_motor.SendStopCommand();
-                                  right_motor.SendStopCommand(); });
+        uint64_t last_cycle_us = 0;
+        uint64_t last_print_us = 0;
+        uint64_t cycle_index = 0;
+        bool stopped = true;
+        DegradedMode degraded(degraded_after->value());
+
+        while (!interrupted)
+        {
+            std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(scheduler.next_start_us(rc::monotonic_us()))));
+
+            FlightRecord record = {};
+            record.type = RECORD_CYCLE;
+
+            mtx.lock();
+            record.time_us = rc::monotonic_us();
+            WheelCommand wheels = controller.update(record.time_us);
+            mtx.unlock();
+
+            uint64_t scheduled_us = scheduler.next_start_us(record.time_us);
+            bool read_health = scheduler.start(record.time_us);
+
+            loop_jitter.observe(record.time_us > scheduled_us ? record.time_us - scheduled_us : 0);
+            if (last_cycle_us > 0)
+            {
+                loop_period.observe(record.time_us - last_cycle_us);
+            }
+            last_cycle_us = record.time_us;
+            cycles.inc();
+
+            // Keep the motors stopped while degraded
+            if (degraded.degraded())
+            {
+                wheels.stop = true;
+                record.flags |= RECORD_DEGRADED;
+            }
+
+            // Request replies on a subset of cycles for liveness,
+            // whenever the motors start or stop, for health samples,
+            // which are taken from the replies, and on every degraded cycle
+            bool reply = reply_interval->value() <= 1 || cycle_index++ % reply_interval->value() == 0 || wheels.stop != stopped || read_health || degraded.degraded();
+
+            if (wheels.stop && !stopped)
+            {
+                stop_events.inc();
+            }
+            stopped = wheels.stop;
+
+            record.move_speed = wheels.move_speed;
+            record.turn_speed = wheels.turn_speed;
+            record.left_speed = wheels.left;
+            record.right_speed = wheels.right;
+
+            if (wheels.stop) {
+                record.flags |= RECORD_STOP;
+                motors.SetStopCommand(0);
+                motors.SetStopCommand(1);
+            } else {
+                motors.SetPositionCommand(0, NAN, -wheels.left, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
+                motors.SetPositionCommand(1, NAN, wheels.right, max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value());
+
+                // Blocking stdio would show up in the measured cycle cost
+                if (verbose->is_set() && record.time_us - last_print_us >= 100000)
+                {
+                    last_print_us = record.time_us;
+                    printf("L: %f, R: %f\n", wheels.left, wheels.right);
+                }
+            }
+
+            // Both commands go out before waiting for either reply, and
+            // the cycle is abandoned at its deadline, so a lost reply
+            // never holds the last wheel speeds for longer. The scheduler
+            // sizes the period to the cost plus headroom, so on time
+            // cycles fit the period with room to spare.
+            int64_t deadline_us = cycle_deadline->value() > 0 ? cycle_deadline->value() : scheduler.period_us();
+            uint64_t start_us = rc::monotonic_us();
+            bool on_time = motors.Cycle(reply, deadline_us, motor_ok);
+            uint64_t cycle_rtt_us = rc::monotonic_us() - start_us;
+            record.left_rtt_us = motors.reply_time_us(0);
+            record.right_rtt_us = motors.reply_time_us(1);
+            bus_utilization.set(motors.bus_time_us() / scheduler.period_us());
+
+            if (!on_time)
+            {
+                record.flags |= RECORD_LATE;
+                late_cycles.inc();
+            }
+
+            // Until the scheduler has fitted the period to the first
+            // window of cycles, late cycles do not degrade the motors
+            if (degraded.update(on_time, scheduler.report().period_us > 0))
+            {
+                degraded_gauge.set(degraded.degraded());
+                if (degraded.degraded())
+                {
+                    printf("Motors degraded: %u cycles late, stopping motors\n", degraded.late_in_row());
+                }
+                else
+                {
+                    printf("Motors recovered: %u cycles on time\n", degraded.on_time_in_row());
+                }
+            }
+
+            bool left_ok = motor_ok[0];
+            bool right_ok = motor_ok[1];
+            record.flags |= (left_ok ? RECORD_LEFT_OK : 0) | (right_ok ? RECORD_RIGHT_OK : 0);
+
+            if (reply)
+            {
+                serial_rtt.observe(cycle_rtt_us);
+            }
+            else
+            {
+                record.flags |= RECORD_NO_REPLY;
+                unreplied_commands.inc(2);
+            }
+            serial_timeouts.inc(!left_ok + !right_ok);
+
+            // Sample motor health at a low rate
+            if (read_health)
+            {
+                State left_state = read_motor_state(motors, 0);
+                State right_state = read_motor_state(motors, 1);
+
+                record.flags |= RECORD_TELEMETRY;
+                record.left = to_motor_telemetry(left_state);
+                record.right = to_motor_telemetry(right_state);
+
+                std::vector<uint8_t> message;
+                rc::encode_health(&message,
+                                  {to_motor_health(left_motor_id->value(), left_state), to_motor_health(right_motor_id->value(), right_state)},
+                                  health_sequence++, record.time_us);
+
+                health_mtx.lock();
+                health_message.swap(message);
+                health_updated = true;
+                health_mtx.unlock();
+            }
+
+            recorder.write(record);
+
+            uint64_t end_us = rc::monotonic_us();
+            uint64_t overruns_before = scheduler.total_overruns();
+            bool adapted = scheduler.finish(end_us, !on_time);
+
+            cycle_cost.observe(end_us - record.time_us);
+            overruns.inc(scheduler.total_overruns() - overruns_before);
+
+            const auto &report = scheduler.report();
+            if (report.period_us > 0)
+            {
+                control_period_gauge.set(report.period_us * 1e-6);
+                control_rate.set(report.achieved_rate_hz);
+                telemetry_rate.set(report.telemetry_rate_hz);
+            }
+
+            if (adapted)
+            {
+                printf("Control period: %lu us (achieved %.1f Hz, cost p95 %lu us, jitter p50 %lu us p99 %lu us, %lu overruns), health rate %.3f Hz\n",
+                       (unsigned long)report.period_us, report.achieved_rate_hz, (unsigned long)report.cost_p95_us,
+                       (unsigned long)report.jitter_p50_us, (unsigned long)report.jitter_p99_us, (unsigned long)report.overruns,
+                       report.telemetry_rate_hz);
+            }
+        }
+
+        // Stop motors on interrupt
+        motors.SetStopCommand(0);
+        motors.SetStopCommand(1);
+        motors.Cycle(true, stop_timeout_us, motor_ok); });
 
     // Start zenoh session
     zenoh::Config zenoh_config;
     zenoh_config.insert_json(Z_CONFIG_MODE_KEY, "\"peer\"");
     auto zenoh_session = zenoh::expect(zenoh::open(std::move(zenoh_config)));
+
+    // Echo commands with their verdict for load tests
+    std::unique_ptr<zenoh::Publisher> zenoh_echo_publisher;
+    std::vector<uint8_t> echo_message;
+
+    if (!echo_key->value().empty())
+    {
+        zenoh_echo_publisher = std::make_unique<zenoh::Publisher>(zenoh::expect(zenoh_session.declare_publisher(echo_key->value())));
+    }
+
+    auto echo = [&](const zenoh::Sample &sample, rc::EchoStatus status)
+    {
+        if (zenoh_echo_publisher)
+        {
+            echo_message.assign(sample.payload.start, sample.payload.start + sample.payload.len);
+            echo_message.push_back(status);
+            zenoh_echo_publisher->put(echo_message);
+        }
+    };
+
     auto zenoh_subscriber = zenoh::expect(zenoh_session.declare_subscriber(key->value(), [&](zenoh::Sample sample)
                                                                            {
-        // read move speed and turn speed as float from payload
+        // read move speed and turn speed from legacy or versioned frame
+        rc::Command command;
+        rc::FrameHeader header;
+
+        messages_received.inc();
+
+        if (!rc::decode_frame(sample.payload.start, sample.payload.len, &command, &header))
+        {
+            messages_malformed.inc();
+            printf("Dropped malformed command (%zu bytes)\n", sample.payload.len);
+            echo(sample, rc::ECHO_MALFORMED);
+            return;
+        }
+
         mtx.lock();
-        memcpy(&move_speed, sample.payload.start + 4, 4);
-        memcpy(&turn_speed, sample.payload.start + 8, 4);
-        last_command_time = std::chrono::steady_clock::now();
-        mtx.unlock(); }));
+        uint64_t now_us = rc::monotonic_us();
+        auto verdict = frame_filter.check(header, now_us);
+        if (verdict == rc::FrameFilter::ACCEPT)
+        {
+            controller.set_command(command.move_y, command.turn, now_us);
+
+            // Recorded under the lock, so the command precedes in the ring
+            // every cycle record that used it
+            FlightRecord record = {};
+            record.type = RECORD_COMMAND;
+            record.time_us = now_us;
+            record.sequence = header.sequence;
+            record.move_speed = command.move_y;
+            record.turn_speed = command.turn;
+            recorder.write(record);
+        }
+        mtx.unlock();
+
+        if (verdict == rc::FrameFilter::OUT_OF_ORDER)
+        {
+            messages_out_of_order.inc();
+            echo(sample, rc::ECHO_OUT_OF_ORDER);
+        }
+        else if (verdict == rc::FrameFilter::STALE)
+        {
+            messages_stale.inc();
+            echo(sample, rc::ECHO_STALE);
+        }
+        else
+        {
+            echo(sample, rc::ECHO_ACCEPTED);
+        }
+ }));
+
+    // Answer health queries from the cached snapshot, never from the motors
+    auto zenoh_health_publisher = zenoh::expect(zenoh_session.declare_publisher(health_key->value()));
+    auto zenoh_health_queryable = zenoh::expect(zenoh_session.declare_queryable(health_key->value(), [&](const zenoh::Query &query)
+                                                                                {
+        health_mtx.lock();
+        std::vector<uint8_t> message = health_message;
+        health_mtx.unlock();
+
+        if (!message.empty())
+        {
+            query.reply(health_key->value(), message);
+        } }));
 
     printf("Subscriber key: %s\n", key->value().c_str());
+    printf("Health key: %s\n", health_key->value().c_str());
+    if (zenoh_echo_publisher)
+    {
+        printf("Echo key: %s\n", echo_key->value().c_str());
+    }
     printf("Press Ctrl+C to exit\n");
 
+    // Publish motor health snapshots as they are sampled
+    std::vector<uint8_t> message;
+
+    while (!interrupted)
+    {
+        usleep(10000); // 10ms
+
+        health_mtx.lock();
+        bool updated = health_updated;
+        if (updated)
+        {
+            message = health_message;
+            health_updated = false;
+        }
+        health_mtx.unlock();
+
+        if (updated)
+        {
+            zenoh_health_publisher.put(message);
+        }
+    }
+
     // Join motors thread on exit
     motors_thread.join();
 
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// Differential drive parameters, see the command line options of
+// differential_drive for their meaning.
+struct DriveParams
+{
+    float wheel_radius = 0.08f;
+    float vehicle_width = 0.31f;
+    float max_move_speed = 1.0f;
+    float max_turn_speed = 2.0f;
+    float stop_threshold = 0.025f;
+    float motor_speed_multiplier = 0.67f;
+    uint64_t kill_timeout_us = 250000;
+};
+
+struct WheelCommand
+{
+    bool stop = true;
+    float move_speed = 0.0f; // after kill timeout and clamping
+    float turn_speed = 0.0f;
+    float left = 0.0f;       // wheel speeds scaled to motor speed values
+    float right = 0.0f;
+};
+
+// Converts move and turn speed commands to wheel speeds. Time is passed in
+// explicitly so the same controller runs on the wall clock, on a virtual
+// clock or over a recording.
+class DriveController
+{
+public:
+    explicit DriveController(const DriveParams &params) : params_(params) {}
+
+    const DriveParams &params() const { return params_; }
+
+    void set_command(float move_speed, float turn_speed, uint64_t now_us)
+    {
+        move_speed_ = move_speed;
+        turn_speed_ = turn_speed;
+        last_command_us_ = now_us;
+        has_command_ = true;
+    }
+
+    WheelCommand update(uint64_t now_us)
+    {
+        WheelCommand out;
+
+        // Set speeds to 0 if no commands have been received recently
+        if (!has_command_ || now_us - last_command_us_ > params_.kill_timeout_us)
+        {
+            move_speed_ = 0;
+            turn_speed_ = 0;
+        }
+
+        // Make sure max speeds are not exceeded
+        float move_speed = clamp(move_speed_, params_.max_move_speed);
+        float turn_speed = clamp(turn_speed_, params_.max_turn_speed);
+
+        out.move_speed = move_speed;
+        out.turn_speed = turn_speed;
+
+        if (std::abs(move_speed) < params_.stop_threshold && std::abs(turn_speed) < params_.stop_threshold)
+        {
+            return out;
+        }
+
+        // Calculate wheel speeds based on r, b
+        float left_wheel_rot_speed = (move_speed - turn_speed * params_.vehicle_width / 2) / params_.wheel_radius;
+        float right_wheel_rot_speed = (move_speed + turn_speed * params_.vehicle_width / 2) / params_.wheel_radius;
+
+        out.stop = false;
+        out.left = left_wheel_rot_speed * params_.motor_speed_multiplier;
+        out.right = right_wheel_rot_speed * params_.motor_speed_multiplier;
+        return out;
+    }
+
+private:
+    static float clamp(float value, float max)
+    {
+        if (std::abs(value) > max)
+        {
+            return value / std::abs(value) * max;
+        }
+        return value;
+    }
+
+    const DriveParams params_;
+    bool has_command_ = false;
+    float move_speed_ = 0.0f;
+    float turn_speed_ = 0.0f;
+    uint64_t last_command_us_ = 0;
+};
@@ -0,0 +1,324 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <popl.hpp>
+#include "degraded_mode.h"
+#include "drive_controller.h"
+#include "flight_recorder.h"
+#include "rate_scheduler.h"
+#include "sim_motor.h"
+
+// Runs the drive controller against simulated robots on a virtual clock.
+// Commands come from a flight recorder file or from a built-in driving
+// pattern, so runs are reproducible and much faster than real time. The
+// motors are driven like in differential_drive: one group cycle for both
+// wheels, on the schedule of a RateScheduler, abandoned at the cycle
+// deadline, and stopped in degraded mode after consecutive late cycles.
+
+struct TimedCommand
+{
+    uint64_t time_us;
+    float move_speed;
+    float turn_speed;
+};
+
+struct MotorParams
+{
+    float max_torque;
+    float feedforward_torque;
+    float kp_scale;
+    float kd_scale;
+    uint64_t cycle_deadline_us;     // 0 for the control period
+    unsigned int degraded_after;
+};
+
+struct SimResult
+{
+    uint64_t cycles = 0;
+    uint64_t simulated_us = 0;
+    uint64_t period_us = 0;         // control period at the end
+    uint64_t late_cycles = 0;
+    uint64_t degraded_cycles = 0;
+    uint64_t degraded_events = 0;
+    uint64_t max_reply_time_us = 0;
+    double velocity_error_sq = 0.0; // sum over cycles and wheels
+    double max_velocity_error = 0.0;
+    double max_torque = 0.0;
+    double max_temperature = 0.0;
+    double left_position = 0.0;
+    double right_position = 0.0;
+};
+
+// Drives forward, turns, spins, reverses and stops, 5 s per segment
+static std::vector<TimedCommand> driving_pattern(double duration_s)
+{
+    const float segments[][2] = {{0.5f, 0.0f}, {0.5f, 0.8f}, {0.0f, 1.5f}, {-0.3f, 0.0f}, {0.0f, 0.0f}};
+    std::vector<TimedCommand> commands;
+
+    for (uint64_t t = 0; t < duration_s * 1e6; t += 10000)
+    {
+        const float *segment = segments[(t / 5000000) % 5];
+        commands.push_back({t, segment[0], segment[1]});
+    }
+    return commands;
+}
+
+static bool load_commands(const std::string &path, std::vector<TimedCommand> *commands, DriveParams *params)
+{
+    FlightRecording recording;
+
+    if (!recording.open(path))
+    {
+        return false;
+    }
+
+    *params = recording.header().params;
+
+    uint64_t first_us = 0;
+    for (uint64_t position = recording.begin(); position < recording.end(); position++)
+    {
+        const FlightRecord *record = recording.at(position);
+        if (!record || record->type != RECORD_COMMAND)
+        {
+            continue;
+        }
+        if (commands->empty())
+        {
+            first_us = record->time_us;
+        }
+        commands->push_back({record->time_us - first_us, record->move_speed, record->turn_speed});
+    }
+    return true;
+}
+
+static SimResult simulate(const std::vector<TimedCommand> &commands, uint64_t duration_us, const DriveParams &params,
+                          const MotorParams &motor, const WheelModel &model, const RateScheduler::Config &scheduler_config,
+                          const SimulatedBus &bus)
+{
+    VirtualClock clock;
+    SimulatedRobot robot(2, model, [&clock]()
+                         { return clock.now_us(); });
+    SimulatedMotorGroup motors(robot, &clock, bus);
+    DriveController controller(params);
+    RateScheduler scheduler(scheduler_config);
+    DegradedMode degraded(motor.degraded_after);
+    bool motor_ok[2];
+
+    SimResult result;
+    size_t next_command = 0;
+
+    while (clock.now_us() < duration_us)
+    {
+        // Same shape as the motors thread: sleep until the scheduled
+        // start, then command both motors in one cycle
+        uint64_t start_us = scheduler.next_start_us(clock.now_us());
+        if (start_us > clock.now_us())
+        {
+            clock.advance(start_us - clock.now_us());
+        }
+        uint64_t now_us = clock.now_us();
+
+        while (next_command < commands.size() && commands[next_command].time_us <= now_us)
+        {
+            const auto &command = commands[next_command++];
+            controller.set_command(command.move_speed, command.turn_speed, command.time_us);
+        }
+
+        WheelCommand wheels = controller.update(now_us);
+        // Health samples come with the replies, they add no simulated time
+        scheduler.start(now_us);
+
+        if (degraded.degraded())
+        {
+            wheels.stop = true;
+            result.degraded_cycles++;
+        }
+
+        if (wheels.stop)
+        {
+            motors.SetStopCommand(0);
+            motors.SetStopCommand(1);
+        }
+        else
+        {
+            motors.SetPositionCommand(0, NAN, -wheels.left, motor.max_torque, motor.feedforward_torque, motor.kp_scale, motor.kd_scale);
+            motors.SetPositionCommand(1, NAN, wheels.right, motor.max_torque, motor.feedforward_torque, motor.kp_scale, motor.kd_scale);
+        }
+
+        int64_t deadline_us = motor.cycle_deadline_us > 0 ? motor.cycle_deadline_us : scheduler.period_us();
+        bool on_time = motors.Cycle(true, deadline_us, motor_ok);
+        result.late_cycles += !on_time;
+        result.max_reply_time_us = std::max({result.max_reply_time_us, motors.reply_time_us(0), motors.reply_time_us(1)});
+        if (degraded.update(on_time, scheduler.report().period_us > 0) && degraded.degraded())
+        {
+            result.degraded_events++;
+        }
+        scheduler.finish(clock.now_us(), !on_time);
+
+        robot.update();
+        result.cycles++;
+
+        const auto &left = robot.wheel(0);
+        const auto &right = robot.wheel(1);
+        double left_error = (wheels.stop ? 0.0 : -wheels.left) - left.velocity;
+        double right_error = (wheels.stop ? 0.0 : wheels.right) - right.velocity;
+        result.velocity_error_sq += left_error * left_error + right_error * right_error;
+        result.max_velocity_error = std::max({result.max_velocity_error, std::abs(left_error), std::abs(right_error)});
+        result.max_torque = std::max({result.max_torque, std::abs(left.torque), std::abs(right.torque)});
+        result.max_temperature = std::max({result.max_temperature, left.temperature, right.temperature});
+    }
+
+    result.simulated_us = clock.now_us();
+    result.period_us = scheduler.period_us();
+    result.left_position = robot.wheel(0).position;
+    result.right_position = robot.wheel(1).position;
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    // Parse arguments
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto input = op.add<popl::Value<std::string>>("i", "input", "flight recorder file with commands, built-in driving pattern if not set");
+    auto duration = op.add<popl::Value<float>>("t", "duration", "simulated time (s), defaults to the length of the input", 3600.0);
+    auto robots = op.add<popl::Value<unsigned int>>("n", "robots", "number of simulated robots, for CPU cost measurements", 1);
+    auto control_period = op.add<popl::Value<unsigned int>>("", "control-period", "target motor control period (us)", 1000);
+    auto max_control_period = op.add<popl::Value<unsigned int>>("", "max-control-period", "slowest motor control period when saturated (us)", 20000);
+    auto headroom = op.add<popl::Value<float>>("", "headroom", "fraction of the control period kept free", 0.25);
+    auto health_rate = op.add<popl::Value<float>>("", "health-rate", "motor health sampling rate (Hz), 0 to disable", 1.0);
+    auto cycle_deadline = op.add<popl::Value<unsigned int>>("", "cycle-deadline", "abandon motor cycles after this time (us), 0 for the control period", 0);
+    auto degraded_after = op.add<popl::Value<unsigned int>>("", "degraded-after", "stop the motors after this many consecutive late cycles, until as many are on time", 3);
+    auto latency = op.add<popl::Value<unsigned int>>("", "latency", "simulated round trip of a motor cycle (us)", 250);
+    auto slow_cycles = op.add<popl::Value<float>>("", "slow-cycles", "fraction of motor cycles with the slow round trip", 0.0);
+    auto slow_latency = op.add<popl::Value<unsigned int>>("", "slow-latency", "simulated round trip of slow motor cycles (us)", 5000);
+    auto r = op.add<popl::Value<float>>("r", "wheel-radius", "wheel radius (m) for differential drive calculation", 0.08);
+    auto b = op.add<popl::Value<float>>("b", "vehicle-width", "distance between wheels (m) for differential drive calculation", 0.31);
+    auto max_move_speed = op.add<popl::Value<float>>("", "max-move-speed", "max moving speed (m/s)", 1.0);
+    auto max_turn_speed = op.add<popl::Value<float>>("", "max-turn-speed", "max turning speed (rad/s)", 2.0);
+    auto kill_timeout = op.add<popl::Value<unsigned int>>("", "kill-timeout", "stop motors if no commands received for this time (ms)", 250);
+    auto stop_threshold = op.add<popl::Value<float>>("", "stop-threshold", "stop motors if move and turn speeds below this value (m/s or rad/s)", 0.025);
+    auto motor_speed_multiplier = op.add<popl::Value<float>>("m", "motor-speed-multiplier", "Multipler to convert wheel rotation speed to motor speed value", 0.67);
+    auto max_torque = op.add<popl::Value<float>>("", "max-torque", "Moteus max_torque", 1.0);
+    auto feedforward_torque = op.add<popl::Value<float>>("", "feedforward-torque", "Moteus feedforward_torque", 0.0);
+    auto kp_scale = op.add<popl::Value<float>>("", "kp-scale", "Moteus kp_scale", 4.0);
+    auto kd_scale = op.add<popl::Value<float>>("", "kd-scale", "Moteus kd_scale", 4.0);
+    auto inertia = op.add<popl::Value<float>>("", "inertia", "simulated reflected inertia per wheel (kg m^2)", 0.004);
+    auto friction = op.add<popl::Value<float>>("", "friction", "simulated viscous friction (Nm per rev/s)", 0.02);
+    auto torque_limit = op.add<popl::Value<float>>("", "torque-limit", "simulated firmware torque limit (Nm)", 2.0);
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    DriveParams params;
+    params.wheel_radius = r->value();
+    params.vehicle_width = b->value();
+    params.max_move_speed = max_move_speed->value();
+    params.max_turn_speed = max_turn_speed->value();
+    params.stop_threshold = stop_threshold->value();
+    params.motor_speed_multiplier = motor_speed_multiplier->value();
+    params.kill_timeout_us = kill_timeout->value() * 1000;
+
+    std::vector<TimedCommand> commands;
+    uint64_t duration_us = duration->value() * 1e6;
+
+    if (input->is_set())
+    {
+        // Controller parameters default to the recorded ones
+        DriveParams recorded;
+        if (!load_commands(input->value(), &commands, &recorded))
+        {
+            return EXIT_FAILURE;
+        }
+        if (!r->is_set())
+            params.wheel_radius = recorded.wheel_radius;
+        if (!b->is_set())
+            params.vehicle_width = recorded.vehicle_width;
+        if (!max_move_speed->is_set())
+            params.max_move_speed = recorded.max_move_speed;
+        if (!max_turn_speed->is_set())
+            params.max_turn_speed = recorded.max_turn_speed;
+        if (!kill_timeout->is_set())
+            params.kill_timeout_us = recorded.kill_timeout_us;
+        if (!stop_threshold->is_set())
+            params.stop_threshold = recorded.stop_threshold;
+        if (!motor_speed_multiplier->is_set())
+            params.motor_speed_multiplier = recorded.motor_speed_multiplier;
+        if (!duration->is_set() && !commands.empty())
+            duration_us = commands.back().time_us + params.kill_timeout_us;
+    }
+    else
+    {
+        commands = driving_pattern(duration->value());
+    }
+
+    MotorParams motor = {max_torque->value(), feedforward_torque->value(), kp_scale->value(), kd_scale->value(),
+                         cycle_deadline->value(), degraded_after->value()};
+
+    SimulatedBus bus;
+    bus.round_trip_us = latency->value();
+    bus.slow_fraction = slow_cycles->value();
+    bus.slow_round_trip_us = slow_latency->value();
+
+    WheelModel model;
+    model.inertia = inertia->value();
+    model.friction = friction->value();
+    model.torque_limit = torque_limit->value();
+
+    RateScheduler::Config scheduler_config;
+    scheduler_config.target_period_us = control_period->value();
+    scheduler_config.max_period_us = std::max(max_control_period->value(), control_period->value());
+    scheduler_config.telemetry_period_us = health_rate->value() > 0 ? 1e6 / health_rate->value() : 0;
+    scheduler_config.headroom = headroom->value();
+
+    auto start = std::chrono::steady_clock::now();
+
+    SimResult result;
+    bool deterministic = true;
+
+    for (unsigned int i = 0; i < std::max(1u, robots->value()); i++)
+    {
+        SimResult run = simulate(commands, duration_us, params, motor, model, scheduler_config, bus);
+        if (i > 0 && (run.cycles != result.cycles || run.late_cycles != result.late_cycles || run.left_position != result.left_position ||
+                      run.right_position != result.right_position))
+        {
+            deterministic = false;
+        }
+        result = run;
+    }
+
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double simulated_s = result.simulated_us / 1e6;
+    unsigned int runs = std::max(1u, robots->value());
+
+    printf("Simulated time: %.1f s (%lu commands, %lu cycles, %.1f Hz, final period %lu us)\n", simulated_s,
+           (unsigned long)commands.size(), (unsigned long)result.cycles, result.cycles / std::max(simulated_s, 1e-9),
+           (unsigned long)result.period_us);
+    printf("Wheel velocity error: rms %.4f rev/s, max %.4f rev/s\n",
+           std::sqrt(result.velocity_error_sq / std::max<uint64_t>(2 * result.cycles, 1)), result.max_velocity_error);
+    printf("Max torque: %.3f Nm, max temperature: %.1f C\n", result.max_torque, result.max_temperature);
+    printf("Wheel travel: L %.2f rev, R %.2f rev\n", result.left_position, result.right_position);
+    printf("Late cycles: %lu, degraded cycles: %lu in %lu episodes, max reply time %lu us\n", (unsigned long)result.late_cycles,
+           (unsigned long)result.degraded_cycles, (unsigned long)result.degraded_events, (unsigned long)result.max_reply_time_us);
+    printf("Wall time: %.3f s for %u robot(s) (%.0fx real time per robot, %.1f ns per robot cycle)%s\n", wall_s, runs,
+           simulated_s * runs / std::max(wall_s, 1e-9), wall_s * 1e9 / std::max<uint64_t>(result.cycles * runs, 1),
+           deterministic ? "" : " NOT DETERMINISTIC");
+
+    return deterministic ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,157 @@
+#include "flight_recorder.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+FlightRecorder::~FlightRecorder()
+{
+    if (header_)
+    {
+        munmap(header_, size_);
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+bool FlightRecorder::open(const std::string &path, uint64_t capacity, const DriveParams &params)
+{
+    if (capacity == 0)
+    {
+        return false;
+    }
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+    {
+        perror("FlightRecorder: unable to open file");
+        return false;
+    }
+
+    size_ = sizeof(FlightRecorderHeader) + capacity * sizeof(FlightRecord);
+
+    struct stat st;
+    bool reuse = fstat(fd_, &st) == 0 && static_cast<size_t>(st.st_size) == size_;
+
+    if (!reuse && ftruncate(fd_, size_) != 0)
+    {
+        perror("FlightRecorder: unable to resize file");
+        return false;
+    }
+
+    void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("FlightRecorder: unable to map file");
+        return false;
+    }
+
+    header_ = static_cast<FlightRecorderHeader *>(mem);
+
+    if (!reuse || header_->magic != FLIGHT_RECORDER_MAGIC || header_->version != FLIGHT_RECORDER_VERSION ||
+        header_->record_size != sizeof(FlightRecord) || header_->capacity != capacity)
+    {
+        memset(mem, 0, size_);
+        header_->magic = FLIGHT_RECORDER_MAGIC;
+        header_->version = FLIGHT_RECORDER_VERSION;
+        header_->record_size = sizeof(FlightRecord);
+        header_->capacity = capacity;
+        header_->head = 0;
+    }
+
+    // Replay uses the parameters of the latest session
+    header_->params = params;
+
+    capacity_ = capacity;
+    records_ = reinterpret_cast<FlightRecord *>(header_ + 1);
+
+    // Write to every page now, keeping its contents, so they are mapped
+    // writable before the control loop starts, and lock them in memory.
+    // Locked, the control loop takes no page faults on the ring; if locking
+    // is not permitted, pages the kernel writes back or reclaims under
+    // memory pressure fault again on the next write.
+    madvise(mem, size_, MADV_WILLNEED);
+    for (size_t offset = 0; offset < size_; offset += 4096)
+    {
+        volatile uint8_t *byte = static_cast<volatile uint8_t *>(mem) + offset;
+        *byte = *byte;
+    }
+    if (mlock(mem, size_) != 0)
+    {
+        perror("FlightRecorder: unable to lock file in memory, recording may page fault");
+    }
+
+    return true;
+}
+
+FlightRecording::~FlightRecording()
+{
+    if (header_)
+    {
+        munmap(const_cast<FlightRecorderHeader *>(header_), size_);
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+bool FlightRecording::open(const std::string &path)
+{
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0)
+    {
+        perror("FlightRecording: unable to open file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FlightRecorderHeader))
+    {
+        fprintf(stderr, "FlightRecording: file too small\n");
+        return false;
+    }
+
+    size_ = st.st_size;
+    void *mem = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("FlightRecording: unable to map file");
+        return false;
+    }
+
+    header_ = static_cast<const FlightRecorderHeader *>(mem);
+
+    if (header_->magic != FLIGHT_RECORDER_MAGIC || header_->version != FLIGHT_RECORDER_VERSION ||
+        header_->record_size != sizeof(FlightRecord) || header_->capacity == 0 ||
+        header_->capacity > (size_ - sizeof(FlightRecorderHeader)) / sizeof(FlightRecord))
+    {
+        fprintf(stderr, "FlightRecording: not a flight recorder file\n");
+        return false;
+    }
+
+    records_ = reinterpret_cast<const FlightRecord *>(header_ + 1);
+    madvise(mem, size_, MADV_SEQUENTIAL);
+    return true;
+}
+
+uint64_t FlightRecording::begin() const
+{
+    uint64_t head = header_->head;
+    return head > header_->capacity ? head - header_->capacity : 0;
+}
+
+const FlightRecord *FlightRecording::at(uint64_t position) const
+{
+    const FlightRecord *record = &records_[position % header_->capacity];
+    if (__atomic_load_n(&record->commit, __ATOMIC_ACQUIRE) != position + 1)
+    {
+        return nullptr;
+    }
+    return record;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "drive_controller.h"
+
+// Flight recorder file layout: a FlightRecorderHeader followed by a ring of
+// `capacity` fixed-size FlightRecords. The file is memory mapped, so
+// records written before a crash are still in the page cache and end up in
+// the file.
+
+constexpr uint32_t FLIGHT_RECORDER_MAGIC = 0x52464352; // "RCFR"
+constexpr uint32_t FLIGHT_RECORDER_VERSION = 1;
+
+enum FlightRecordType : uint8_t
+{
+    RECORD_COMMAND = 1, // command received from zenoh
+    RECORD_CYCLE = 2,   // motor control cycle
+};
+
+enum FlightRecordFlags : uint8_t
+{
+    RECORD_STOP = 0x01,      // stop command sent instead of wheel speeds
+    RECORD_LEFT_OK = 0x02,   // left motor replied
+    RECORD_RIGHT_OK = 0x04,  // right motor replied
+    RECORD_TELEMETRY = 0x08, // motor telemetry fields are valid
+    RECORD_NO_REPLY = 0x10,  // commands sent without reply, OK flags mean sent
+    RECORD_LATE = 0x20,      // cycle missed its deadline and was abandoned
+    RECORD_DEGRADED = 0x40,  // motors stopped in degraded mode
+};
+
+struct MotorTelemetry
+{
+    float position;
+    float velocity;
+    float torque;
+    float voltage;
+    float temperature;
+    int16_t fault;
+    int16_t mode;
+};
+
+struct FlightRecord
+{
+    uint64_t commit;       // ring position + 1, written last
+    uint64_t time_us;      // subscriber monotonic time
+    uint8_t type;          // FlightRecordType
+    uint8_t flags;         // FlightRecordFlags
+    uint16_t reserved;
+    uint32_t sequence;     // command frame sequence number
+    float move_speed;      // received or applied command
+    float turn_speed;
+    float left_speed;      // computed wheel speeds
+    float right_speed;
+    uint32_t left_rtt_us;  // time from the cycle start to each motor's
+    uint32_t right_rtt_us; // reply, the whole cycle if it did not reply
+    MotorTelemetry left;
+    MotorTelemetry right;
+};
+
+static_assert(sizeof(FlightRecord) == 96, "FlightRecord layout changed");
+
+struct FlightRecorderHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t head; // number of records ever written
+    DriveParams params;
+};
+
+class FlightRecorder
+{
+public:
+    FlightRecorder() = default;
+    FlightRecorder(FlightRecorder const &) = delete;
+    ~FlightRecorder();
+
+    // Maps the ring file, creating it if it does not exist or does not
+    // match capacity. An existing matching file is appended to.
+    bool open(const std::string &path, uint64_t capacity, const DriveParams &params);
+
+    bool is_open() const { return records_ != nullptr; }
+
+    // Copies a record into the ring. Safe to call from several threads.
+    void write(const FlightRecord &record)
+    {
+        if (!records_)
+        {
+            return;
+        }
+
+        uint64_t position = __atomic_fetch_add(&header_->head, 1, __ATOMIC_RELAXED);
+        FlightRecord &slot = records_[position % capacity_];
+        __atomic_store_n(&slot.commit, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot = record;
+        __atomic_store_n(&slot.commit, position + 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    int fd_ = -1;
+    size_t size_ = 0;
+    FlightRecorderHeader *header_ = nullptr;
+    FlightRecord *records_ = nullptr;
+    uint64_t capacity_ = 0;
+};
+
+// Read-only view of a recording, iterates records from oldest to newest.
+class FlightRecording
+{
+public:
+    FlightRecording() = default;
+    FlightRecording(FlightRecording const &) = delete;
+    ~FlightRecording();
+
+    bool open(const std::string &path);
+
+    const FlightRecorderHeader &header() const { return *header_; }
+
+    // Index range of the records still present in the ring
+    uint64_t begin() const;
+    uint64_t end() const { return header_->head; }
+
+    // Returns the record at ring position, or nullptr if it was not
+    // completely written
+    const FlightRecord *at(uint64_t position) const;
+
+private:
+    int fd_ = -1;
+    size_t size_ = 0;
+    const FlightRecorderHeader *header_ = nullptr;
+    const FlightRecord *records_ = nullptr;
+};
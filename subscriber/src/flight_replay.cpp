@@ -0,0 +1,189 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <popl.hpp>
+#include "drive_controller.h"
+#include "flight_recorder.h"
+
+// Replays a flight recorder file through DriveController and compares the
+// computed wheel speeds with the recorded ones.
+
+int main(int argc, char *argv[])
+{
+    // Parse arguments
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto input = op.add<popl::Value<std::string>>("i", "input", "flight recorder file", "flight_recorder.bin");
+    auto speed = op.add<popl::Value<float>>("s", "speed", "replay speed relative to real time, 0 for as fast as possible", 0.0);
+    auto repeat = op.add<popl::Value<unsigned int>>("n", "repeat", "number of replay passes, for benchmarking", 1);
+    auto verbose = op.add<popl::Switch>("v", "verbose", "print every mismatching cycle");
+    auto r = op.add<popl::Value<float>>("r", "wheel-radius", "override recorded wheel radius (m)");
+    auto b = op.add<popl::Value<float>>("b", "vehicle-width", "override recorded distance between wheels (m)");
+    auto max_move_speed = op.add<popl::Value<float>>("", "max-move-speed", "override recorded max moving speed (m/s)");
+    auto max_turn_speed = op.add<popl::Value<float>>("", "max-turn-speed", "override recorded max turning speed (rad/s)");
+    auto kill_timeout = op.add<popl::Value<unsigned int>>("", "kill-timeout", "override recorded kill timeout (ms)");
+    auto stop_threshold = op.add<popl::Value<float>>("", "stop-threshold", "override recorded stop threshold (m/s or rad/s)");
+    auto motor_speed_multiplier = op.add<popl::Value<float>>("m", "motor-speed-multiplier", "override recorded motor speed multiplier");
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    FlightRecording recording;
+
+    if (!recording.open(input->value()))
+    {
+        return EXIT_FAILURE;
+    }
+
+    DriveParams params = recording.header().params;
+    if (r->is_set())
+        params.wheel_radius = r->value();
+    if (b->is_set())
+        params.vehicle_width = b->value();
+    if (max_move_speed->is_set())
+        params.max_move_speed = max_move_speed->value();
+    if (max_turn_speed->is_set())
+        params.max_turn_speed = max_turn_speed->value();
+    if (kill_timeout->is_set())
+        params.kill_timeout_us = kill_timeout->value() * 1000;
+    if (stop_threshold->is_set())
+        params.stop_threshold = stop_threshold->value();
+    if (motor_speed_multiplier->is_set())
+        params.motor_speed_multiplier = motor_speed_multiplier->value();
+
+    const uint64_t begin = recording.begin();
+    const uint64_t end = recording.end();
+
+    uint64_t commands = 0;
+    uint64_t cycles = 0;
+    uint64_t torn = 0;
+    uint64_t mismatches = 0;
+    uint64_t reply_failures = 0;
+    uint64_t late_cycles = 0;
+    uint64_t degraded_cycles = 0;
+    uint64_t rtt_sum_us = 0;
+    uint64_t rtt_max_us = 0;
+    uint64_t first_us = 0;
+    uint64_t last_us = 0;
+
+    auto replay_start = std::chrono::steady_clock::now();
+
+    for (unsigned int pass = 0; pass < repeat->value(); pass++)
+    {
+        DriveController controller(params);
+
+        // Once the ring has wrapped, the command in effect for the oldest
+        // cycles is lost, so only compare cycles after the first command
+        bool synced = false;
+
+        for (uint64_t position = begin; position < end; position++)
+        {
+            const FlightRecord *record = recording.at(position);
+
+            if (!record)
+            {
+                torn++;
+                continue;
+            }
+
+            if (first_us == 0)
+            {
+                first_us = record->time_us;
+            }
+            last_us = record->time_us;
+
+            // Pace the replay against the recorded timestamps
+            if (speed->value() > 0)
+            {
+                auto due = replay_start + std::chrono::microseconds(static_cast<uint64_t>((record->time_us - first_us) / speed->value()));
+                std::this_thread::sleep_until(due);
+            }
+
+            if (record->type == RECORD_COMMAND)
+            {
+                controller.set_command(record->move_speed, record->turn_speed, record->time_us);
+                commands++;
+                synced = true;
+                continue;
+            }
+
+            if (record->type != RECORD_CYCLE)
+            {
+                continue;
+            }
+
+            cycles++;
+            WheelCommand wheels = controller.update(record->time_us);
+
+            // Degraded cycles stopped the motors regardless of the controller
+            bool recorded_stop = record->flags & RECORD_STOP;
+            bool match = !synced || (record->flags & RECORD_DEGRADED) ||
+                         (wheels.stop == recorded_stop &&
+                          (wheels.stop || (std::abs(wheels.left - record->left_speed) < 1e-4f && std::abs(wheels.right - record->right_speed) < 1e-4f)));
+
+            if (!match)
+            {
+                mismatches++;
+                if (verbose->is_set())
+                {
+                    printf("t=%.6f recorded L: %f, R: %f%s replayed L: %f, R: %f%s\n",
+                           (record->time_us - first_us) / 1e6,
+                           record->left_speed, record->right_speed, recorded_stop ? " (stop)" : "",
+                           wheels.left, wheels.right, wheels.stop ? " (stop)" : "");
+                }
+            }
+
+            if (pass == 0)
+            {
+                if (!(record->flags & RECORD_LEFT_OK) || !(record->flags & RECORD_RIGHT_OK))
+                {
+                    reply_failures++;
+                }
+                late_cycles += (record->flags & RECORD_LATE) != 0;
+                degraded_cycles += (record->flags & RECORD_DEGRADED) != 0;
+                // Both motors are commanded in the same cycle
+                uint64_t rtt_us = std::max(record->left_rtt_us, record->right_rtt_us);
+                rtt_sum_us += rtt_us;
+                rtt_max_us = std::max(rtt_max_us, rtt_us);
+            }
+        }
+    }
+
+    double replay_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+    double recorded_s = (last_us - first_us) / 1e6;
+    uint64_t passes = repeat->value();
+    uint64_t cycles_per_pass = passes ? cycles / passes : 0;
+
+    printf("Records: %lu (%lu commands, %lu cycles, %lu incomplete)\n",
+           (unsigned long)(end - begin), (unsigned long)(commands / std::max<uint64_t>(passes, 1)),
+           (unsigned long)cycles_per_pass, (unsigned long)(torn / std::max<uint64_t>(passes, 1)));
+    printf("Recorded duration: %.3f s\n", recorded_s);
+    printf("Mismatching cycles: %lu\n", (unsigned long)(mismatches / std::max<uint64_t>(passes, 1)));
+    printf("Cycles without motor reply: %lu\n", (unsigned long)reply_failures);
+    printf("Late cycles: %lu, degraded cycles: %lu\n", (unsigned long)late_cycles, (unsigned long)degraded_cycles);
+    if (cycles_per_pass > 0)
+    {
+        printf("Serial RTT per cycle: mean %.1f us, max %lu us\n", (double)rtt_sum_us / cycles_per_pass, (unsigned long)rtt_max_us);
+    }
+    printf("Replay time: %.3f s (%.1fx real time, %.1f ns per record)\n",
+           replay_s, replay_s > 0 ? recorded_s * passes / replay_s : 0.0,
+           end > begin ? replay_s * 1e9 / ((end - begin) * passes) : 0.0);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <popl.hpp>
+#include <moteus_protocol.h>
+#include <MoteusTransport.h>
+
+// Emulates moteus controllers on a SocketCAN interface, so the socketcan
+// backend can be tested on a vcan interface without hardware. Written
+// registers are stored, position mode integrates the commanded velocity,
+// and read registers are replied when the command requests a reply.
+
+using namespace mjbots::moteus;
+
+bool interrupted = false;
+
+void interrupt_handler(int)
+{
+    interrupted = true;
+}
+
+struct Servo
+{
+    std::map<uint32_t, double> registers = {
+        {kMode, static_cast<double>(Mode::kStopped)}, {kPosition, 0}, {kVelocity, 0}, {kTorque, 0},
+        {kVoltage, 24.0}, {kTemperature, 30.0}, {kFault, 0}};
+    std::chrono::steady_clock::time_point updated = std::chrono::steady_clock::now();
+};
+
+static size_t resolution_size(Resolution resolution)
+{
+    return resolution == Resolution::kInt8 ? 1 : resolution == Resolution::kInt16 ? 2 : 4;
+}
+
+// Applies the write blocks of a command and collects its read blocks.
+// Returns false if the frame holds anything else.
+static bool process(Servo &servo, const uint8_t *data, size_t size, std::vector<RegisterAccess> &reads)
+{
+    size_t offset = 0;
+    while (offset < size)
+    {
+        const uint8_t cmd = data[offset++];
+        if (cmd == kNop)
+        {
+            continue;
+        }
+        if (cmd >= kReplyBase || offset >= size)
+        {
+            return false;
+        }
+
+        const Resolution resolution = static_cast<Resolution>((cmd >> 2) & 0x03);
+        size_t count = cmd & 0x03;
+        if (count == 0)
+        {
+            count = data[offset++];
+        }
+        if (offset >= size || data[offset] >= 0x80)
+        {
+            return false;
+        }
+        const uint32_t start = data[offset++];
+
+        if (cmd < kReadBase)
+        {
+            if (offset + count * resolution_size(resolution) > size)
+            {
+                return false;
+            }
+            MultiplexParser values(data + offset, size - offset);
+            for (size_t i = 0; i < count; i++)
+            {
+                servo.registers[start + i] = values.ReadRegister(start + i, resolution);
+            }
+            offset += count * resolution_size(resolution);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                reads.push_back({static_cast<Register>(start + i), resolution});
+            }
+        }
+    }
+    return true;
+}
+
+// Moves the servo since its last command
+static void update(Servo &servo)
+{
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - servo.updated).count();
+    servo.updated = now;
+
+    double velocity = 0;
+    if (servo.registers[kMode] == static_cast<double>(Mode::kPosition))
+    {
+        velocity = servo.registers.count(kCommandVelocity) ? servo.registers[kCommandVelocity] : 0;
+        if (std::isnan(velocity))
+        {
+            velocity = 0;
+        }
+    }
+    servo.registers[kPosition] += velocity * dt;
+    servo.registers[kVelocity] = velocity;
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGINT, interrupt_handler);
+
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto interface = op.add<popl::Value<std::string>>("i", "interface", "CAN interface", "vcan0");
+    auto ids = op.add<popl::Value<std::string>>("", "ids", "comma separated IDs of the emulated controllers", "1,2");
+    auto verbose = op.add<popl::Switch>("v", "verbose", "print received commands");
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::map<uint8_t, Servo> servos;
+    std::stringstream id_list(ids->value());
+    for (std::string id; std::getline(id_list, id, ',');)
+    {
+        servos[static_cast<uint8_t>(std::stoi(id))] = Servo();
+    }
+
+    // Receives every frame on the bus, including the replies of the
+    // emulated controllers, which are ignored by destination
+    int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    int enable = 1;
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, interface->value().c_str(), IFNAMSIZ - 1);
+
+    if (fd < 0 || setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) < 0 ||
+        ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+        std::cerr << "Unable to open " << interface->value() << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_can address = {};
+    address.can_family = AF_CAN;
+    address.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        std::cerr << "Unable to open " << interface->value() << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Wake up regularly to check for interrupts
+    timeval timeout = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    printf("Emulating %zu controllers on %s\n", servos.size(), interface->value().c_str());
+
+    uint64_t commands = 0;
+    uint64_t replies = 0;
+    std::vector<RegisterAccess> reads;
+
+    while (!interrupted)
+    {
+        canfd_frame in;
+        ssize_t n = read(fd, &in, sizeof(in));
+        if (n != CANFD_MTU && n != CAN_MTU)
+        {
+            continue;
+        }
+
+        const uint32_t id = in.can_id & CAN_EFF_MASK;
+        const uint8_t source = (id >> 8) & 0x7f;
+        const uint8_t destination = id & 0x7f;
+        auto servo = servos.find(destination);
+        if (!(in.can_id & CAN_EFF_FLAG) || servo == servos.end())
+        {
+            continue;
+        }
+
+        commands++;
+        reads.clear();
+        update(servo->second);
+        if (!process(servo->second, in.data, in.len, reads))
+        {
+            std::cerr << "Unsupported command for " << int(destination) << std::endl;
+            continue;
+        }
+        if (verbose->is_set())
+        {
+            printf("%02x -> %02x: %u bytes, %zu reads%s\n", source, destination, in.len, reads.size(), (id & 0x8000) ? ", reply" : "");
+        }
+        if (!(id & 0x8000))
+        {
+            continue;
+        }
+
+        std::sort(reads.begin(), reads.end(), [](const RegisterAccess &a, const RegisterAccess &b)
+                  { return a.reg < b.reg; });
+        for (auto &access : reads)
+        {
+            auto value = servo->second.registers.find(access.reg);
+            access.value = value != servo->second.registers.end() ? value->second : 0;
+        }
+
+        CanFrame reply;
+        WriteCanFrame writer(&reply);
+        try
+        {
+            detail::EmitRegisterAccesses(&writer, kReplyBase, reads.data(), reads.size(), true);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Unable to reply: " << e.what() << std::endl;
+            continue;
+        }
+
+        canfd_frame out = {};
+        out.can_id = CAN_EFF_FLAG | (destination << 8) | source;
+        out.len = CanFdLength(reply.size);
+        out.flags = in.flags & CANFD_BRS;
+        memcpy(out.data, reply.data, reply.size);
+        memset(out.data + reply.size, kNop, out.len - reply.size);
+        if (write(fd, &out, CANFD_MTU) == CANFD_MTU)
+        {
+            replies++;
+        }
+    }
+
+    printf("\n%lu commands, %lu replies\n", static_cast<unsigned long>(commands), static_cast<unsigned long>(replies));
+    close(fd);
+    return EXIT_SUCCESS;
+}
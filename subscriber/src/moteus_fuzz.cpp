@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <moteus_protocol.h>
+#include "protocol_checks.h"
+
+// libFuzzer harness for the moteus codec, built with -DRC_FUZZ=ON and
+// clang. The input is parsed as a reply by all parsers, which must agree,
+// and also read as a list of registers, resolutions and values that are
+// encoded as a reply and must parse back.
+//
+//   ./moteus_fuzz -max_len=64 corpus/
+
+using namespace mjbots::moteus;
+using namespace protocol_checks;
+
+// Encodes registers chosen by the input, 3 bytes each: selection and
+// resolution, then the value as a fraction of the register's range
+static void check_round_trip(const uint8_t *data, size_t size)
+{
+    std::vector<RegisterAccess> accesses;
+    size_t offset = 0;
+    for (Register reg : fuzz_registers)
+    {
+        if (offset + 3 > size)
+        {
+            break;
+        }
+        const uint8_t *record = data + offset;
+        offset += 3;
+        if (!(record[0] & 1))
+        {
+            continue;
+        }
+
+        RegisterAccess access;
+        access.reg = reg;
+        access.resolution = resolutions[(record[0] >> 1) & 3];
+        int16_t fraction = static_cast<int16_t>(record[1] | record[2] << 8);
+        access.value = 0.9 * value_range(reg, access.resolution) * fraction / 32768.0;
+        accesses.push_back(access);
+    }
+
+    CanFrame frame;
+    WriteCanFrame writer(&frame);
+    try
+    {
+        detail::EmitRegisterAccesses(&writer, kReplyBase, accesses.data(), accesses.size(), true);
+    }
+    catch (const std::runtime_error &)
+    {
+        // Too many registers for one frame
+        return;
+    }
+
+    std::vector<RegisterAccess> parsed = accesses;
+    ParseRegisterReply(frame.data, frame.size, parsed.data(), parsed.size());
+    for (size_t k = 0; k < accesses.size(); k++)
+    {
+        if (!round_trips(accesses[k], parsed[k].value))
+        {
+            fprintf(stderr, "Register 0x%03x: wrote %g, read %g\n", accesses[k].reg, accesses[k].value, parsed[k].value);
+            abort();
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > sizeof(CanFrame::data))
+    {
+        return -1;
+    }
+
+    // The input buffer is exactly sized, so any overread is caught
+    std::vector<RegisterAccess> accesses;
+    for (Register reg : fuzz_registers)
+    {
+        RegisterAccess access;
+        access.reg = reg;
+        accesses.push_back(access);
+    }
+    try
+    {
+        if (!parsers_agree(data, size, accesses.data(), accesses.size()))
+        {
+            fprintf(stderr, "Query parsers disagree on a %zu byte reply\n", size);
+            abort();
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "Parsing a %zu byte reply threw: %s\n", size, e.what());
+        abort();
+    }
+
+    check_round_trip(data, size);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <MoteusAPI.h>
+#include <MoteusGroup.h>
+
+// All motors of the robot, commanded together: commands are set per motor
+// and sent by one cycle, which reports per motor whether it succeeded.
+// Implemented by moteus controllers and by the simulation (sim_motor.h).
+class MotorGroup
+{
+public:
+    virtual ~MotorGroup() = default;
+
+    virtual size_t size() const = 0;
+    virtual void SetPositionCommand(size_t i, double stop_position, double velocity, double max_torque,
+                                    double feedforward_torque, double kp_scale, double kd_scale) = 0;
+    virtual void SetStopCommand(size_t i) = 0;
+    // Sends the commands of all motors within timeout_us, ok receives one
+    // flag per motor. Returns false if the deadline was missed and the
+    // rest of the cycle abandoned.
+    virtual bool Cycle(bool reply, int64_t timeout_us, bool *ok) = 0;
+    // Time from the start of the last cycle until motor i replied, or was
+    // sent its command without reply; the whole cycle if it was neither
+    virtual uint64_t reply_time_us(size_t i) const = 0;
+    // Health and telemetry of motor i, fields stay NAN if it does not reply
+    virtual void ReadState(size_t i, State &curr_state) = 0;
+    // Bus time of the busiest bus in the last cycle, and at most for a
+    // replied cycle of the current commands (us), 0 without a CAN bus
+    virtual double bus_time_us() const { return 0; }
+    virtual double EstimateBusTimeUs() const { return 0; }
+};
+
+// moteus controllers on one or more transports, all commands of a cycle
+// are sent before the replies are collected. Every command of a replied
+// cycle queries the motor state, so ReadState returns the state of the
+// last replied cycle without another round trip.
+class MoteusMotorGroup : public MotorGroup
+{
+public:
+    MoteusMotorGroup(const std::vector<MoteusGroup::Servo> &servos, const MoteusGroup::Options &options)
+        : group_(servos, options) {}
+
+    size_t size() const override { return group_.size(); }
+
+    void SetPositionCommand(size_t i, double stop_position, double velocity, double max_torque,
+                            double feedforward_torque, double kp_scale, double kd_scale) override
+    {
+        mjbots::moteus::PositionCommand command;
+        command.position = NAN;
+        command.velocity = velocity;
+        command.maximum_torque = max_torque;
+        command.stop_position = stop_position;
+        command.kp_scale = kp_scale;
+        command.kd_scale = kd_scale;
+        command.feedforward_torque = feedforward_torque;
+        command.watchdog_timeout = NAN;
+        group_.SetPositionCommand(i, command);
+    }
+
+    void SetStopCommand(size_t i) override { group_.SetStopCommand(i); }
+
+    bool Cycle(bool reply, int64_t timeout_us, bool *ok) override
+    {
+        group_.Cycle(reply, timeout_us);
+        for (size_t i = 0; i < group_.size(); i++)
+        {
+            ok[i] = group_.ok(i);
+        }
+        replied_ = reply;
+        return !group_.deadline_missed();
+    }
+
+    uint64_t reply_time_us(size_t i) const override { return group_.reply_time_us(i); }
+
+    void ReadState(size_t i, State &curr_state) override
+    {
+        if (!replied_ || !group_.ok(i))
+        {
+            return;
+        }
+
+        const mjbots::moteus::QueryState &state = group_.states()[i];
+        curr_state.position = state.position;
+        curr_state.velocity = state.velocity;
+        curr_state.torque = state.torque;
+        curr_state.q_curr = state.q_current;
+        curr_state.d_curr = state.d_current;
+        curr_state.rezero_state = state.rezero_state;
+        curr_state.voltage = state.voltage;
+        curr_state.temperature = state.temperature;
+        curr_state.fault = state.fault;
+        curr_state.mode = state.mode;
+    }
+
+    double bus_time_us() const override
+    {
+        double time_us = 0;
+        for (size_t b = 0; b < group_.bus_count(); b++)
+        {
+            time_us = std::max(time_us, group_.bus_time_us(b));
+        }
+        return time_us;
+    }
+
+    double EstimateBusTimeUs() const override
+    {
+        double time_us = 0;
+        for (size_t b = 0; b < group_.bus_count(); b++)
+        {
+            time_us = std::max(time_us, group_.EstimateBusTimeUs(b));
+        }
+        return time_us;
+    }
+
+private:
+    MoteusGroup group_;
+    bool replied_ = false;
+};
@@ -0,0 +1,286 @@
+#include "motor_discovery.h"
+
+#include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <FdcanusbTransport.h>
+
+static int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::vector<std::string> list_adapter_devices()
+{
+    std::vector<std::string> devices;
+    glob_t matches;
+    if (glob("/dev/ttyACM*", 0, nullptr, &matches) == 0)
+    {
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+        {
+            devices.push_back(matches.gl_pathv[i]);
+        }
+    }
+    globfree(&matches);
+    std::sort(devices.begin(), devices.end());
+    return devices;
+}
+
+std::string adapter_serial(const std::string &device)
+{
+    // /sys/class/tty/ttyACMn/device is the USB interface, the serial is an
+    // attribute of the USB device above it
+    const std::string name = device.substr(device.rfind('/') + 1);
+    char interface[PATH_MAX];
+    if (realpath(("/sys/class/tty/" + name + "/device").c_str(), interface))
+    {
+        std::ifstream file(std::string(interface) + "/../serial");
+        std::string serial;
+        if (std::getline(file, serial) && !serial.empty())
+        {
+            return serial;
+        }
+    }
+    return device;
+}
+
+std::vector<int> probe_motors(const std::string &device, const std::vector<int> &ids, int64_t timeout_us)
+{
+    std::vector<int> found;
+    std::unique_ptr<FdcanusbTransport> transport;
+    try
+    {
+        transport = std::make_unique<FdcanusbTransport>(device);
+    }
+    catch (const std::exception &e)
+    {
+        return found;
+    }
+
+    // Only the mode is queried, the reply itself is the answer
+    mjbots::moteus::QueryCommand query;
+    query.position = query.velocity = query.torque = mjbots::moteus::Resolution::kIgnore;
+    query.q_current = query.d_current = query.rezero_state = mjbots::moteus::Resolution::kIgnore;
+    query.voltage = query.temperature = query.fault = mjbots::moteus::Resolution::kIgnore;
+
+    std::vector<MoteusFrame> frames(ids.size());
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        frames[i].destination = ids[i];
+        frames[i].reply_required = true;
+        mjbots::moteus::WriteCanFrame write_frame(&frames[i].can);
+        mjbots::moteus::EmitQueryCommand(&write_frame, query);
+    }
+
+    const int64_t deadline_us = now_us() + timeout_us;
+    if (!transport->Send(frames.data(), frames.size(), timeout_us))
+    {
+        return found;
+    }
+
+    std::vector<MoteusFrame> replies(ids.size());
+    while (found.size() < ids.size())
+    {
+        const int64_t remaining_us = deadline_us - now_us();
+        int count = remaining_us > 0 ? transport->Receive(replies.data(), replies.size(), remaining_us) : 0;
+        if (count <= 0)
+        {
+            break;
+        }
+        for (int k = 0; k < count; k++)
+        {
+            const int id = replies[k].source;
+            if (std::find(ids.begin(), ids.end(), id) != ids.end() && std::find(found.begin(), found.end(), id) == found.end())
+            {
+                found.push_back(id);
+            }
+        }
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+std::vector<MotorAdapter> discover_motors(const std::vector<std::string> &devices, const std::vector<int> &ids, int64_t timeout_us)
+{
+    // All adapters wait for their timeouts at the same time
+    std::vector<MotorAdapter> probed(devices.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        threads.emplace_back([&, i]()
+                             {
+            probed[i].device = devices[i];
+            probed[i].serial = adapter_serial(devices[i]);
+            probed[i].ids = probe_motors(devices[i], ids, timeout_us); });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    std::vector<MotorAdapter> adapters;
+    for (MotorAdapter &adapter : probed)
+    {
+        if (!adapter.ids.empty())
+        {
+            adapters.push_back(std::move(adapter));
+        }
+    }
+    return adapters;
+}
+
+bool load_topology(const std::string &path, std::vector<MotorAdapter> &adapters)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+
+    adapters.clear();
+    for (std::string line; std::getline(file, line);)
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        MotorAdapter adapter;
+        std::string device, ids;
+        if (!(fields >> adapter.serial >> device >> ids))
+        {
+            return false;
+        }
+        std::istringstream list(ids);
+        for (std::string id; std::getline(list, id, ',');)
+        {
+            adapter.ids.push_back(std::atoi(id.c_str()));
+        }
+        adapters.push_back(std::move(adapter));
+    }
+    return true;
+}
+
+bool save_topology(const std::string &path, const std::vector<MotorAdapter> &adapters)
+{
+    // Replaced in one rename, so a crash never leaves half a cache
+    const std::string temp_path = path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (!file)
+    {
+        perror("Topology cache: unable to open file");
+        return false;
+    }
+
+    fprintf(file, "# serial device ids\n");
+    for (const MotorAdapter &adapter : adapters)
+    {
+        fprintf(file, "%s %s ", adapter.serial.c_str(), adapter.device.c_str());
+        for (size_t i = 0; i < adapter.ids.size(); i++)
+        {
+            fprintf(file, i ? ",%d" : "%d", adapter.ids[i]);
+        }
+        fprintf(file, "\n");
+    }
+
+    bool ok = fclose(file) == 0;
+    return ok && rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+// Device of each motor ID among adapters present now, false if one is not
+static bool resolve_devices(const std::vector<int> &motor_ids, const std::vector<MotorAdapter> &adapters, std::vector<std::string> &devices)
+{
+    devices.assign(motor_ids.size(), "");
+    for (size_t i = 0; i < motor_ids.size(); i++)
+    {
+        for (const MotorAdapter &adapter : adapters)
+        {
+            if (!adapter.device.empty() && std::find(adapter.ids.begin(), adapter.ids.end(), motor_ids[i]) != adapter.ids.end())
+            {
+                devices[i] = adapter.device;
+                break;
+            }
+        }
+        if (devices[i].empty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool locate_motors(const std::vector<int> &motor_ids, const std::string &cache_path, int max_id, int64_t timeout_us, std::vector<std::string> &devices)
+{
+    const std::vector<std::string> present = list_adapter_devices();
+
+    std::vector<MotorAdapter> cached;
+    if (!cache_path.empty() && load_topology(cache_path, cached))
+    {
+        // Cached serials to their current devices
+        for (MotorAdapter &adapter : cached)
+        {
+            adapter.device.clear();
+            for (const std::string &device : present)
+            {
+                if (adapter_serial(device) == adapter.serial)
+                {
+                    adapter.device = device;
+                }
+            }
+        }
+
+        bool verified = resolve_devices(motor_ids, cached, devices);
+        for (size_t i = 0; verified && i < motor_ids.size(); i++)
+        {
+            verified = !probe_motors(devices[i], {motor_ids[i]}, timeout_us).empty();
+        }
+        if (verified)
+        {
+            printf("Motor adapters from topology cache %s\n", cache_path.c_str());
+            return true;
+        }
+        printf("Topology cache %s is stale, probing adapters\n", cache_path.c_str());
+    }
+
+    std::vector<int> ids;
+    for (int id = 1; id <= max_id; id++)
+    {
+        ids.push_back(id);
+    }
+    for (int id : motor_ids)
+    {
+        if (std::find(ids.begin(), ids.end(), id) == ids.end())
+        {
+            ids.push_back(id);
+        }
+    }
+
+    const std::vector<MotorAdapter> adapters = discover_motors(present, ids, timeout_us);
+    for (const MotorAdapter &adapter : adapters)
+    {
+        printf("Adapter %s on %s: IDs", adapter.serial.c_str(), adapter.device.c_str());
+        for (int id : adapter.ids)
+        {
+            printf(" %d", id);
+        }
+        printf("\n");
+    }
+
+    if (!resolve_devices(motor_ids, adapters, devices))
+    {
+        return false;
+    }
+    if (!cache_path.empty() && !save_topology(cache_path, adapters))
+    {
+        fprintf(stderr, "Unable to write topology cache %s\n", cache_path.c_str());
+    }
+    return true;
+}
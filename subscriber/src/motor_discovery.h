@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Finds which fdcanusb adapter each moteus controller is connected to, so
+// the subscriber does not depend on the USB enumeration order.
+
+// An adapter and the moteus IDs that answered on it. Adapters are keyed by
+// their USB serial, the device path is where they are now.
+struct MotorAdapter
+{
+    std::string serial;
+    std::string device;
+    std::vector<int> ids;
+};
+
+// All /dev/ttyACM* devices, sorted
+std::vector<std::string> list_adapter_devices();
+
+// USB serial of the device behind a tty, or the device path if it has none
+std::string adapter_serial(const std::string &device);
+
+// Queries the given moteus IDs on an fdcanusb with one batch of frames and
+// returns those that replied within timeout_us. Returns as soon as all
+// replied, so probing known IDs is fast.
+std::vector<int> probe_motors(const std::string &device, const std::vector<int> &ids, int64_t timeout_us);
+
+// Probes all devices concurrently, one thread each. Devices that cannot be
+// opened or where no ID replied are left out.
+std::vector<MotorAdapter> discover_motors(const std::vector<std::string> &devices, const std::vector<int> &ids, int64_t timeout_us);
+
+// Topology cache, one line per adapter: serial, last device path and IDs.
+// Devices are not read back, as they change between boots.
+bool load_topology(const std::string &path, std::vector<MotorAdapter> &adapters);
+bool save_topology(const std::string &path, const std::vector<MotorAdapter> &adapters);
+
+// Finds the device of each of the given motor IDs. The cached topology is
+// tried first and only checked by querying the cached motors; if it is
+// missing or stale, all adapters are probed for IDs 1 to max_id and the
+// cache is rewritten. Returns false if a motor was not found.
+bool locate_motors(const std::vector<int> &motor_ids, const std::string &cache_path, int max_id, int64_t timeout_us, std::vector<std::string> &devices);
@@ -0,0 +1,456 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <popl.hpp>
+#include <moteus_protocol.h>
+#include "protocol_checks.h"
+
+// Measures the moteus codec: command encoding at each resolution and the
+// reply parsers on typical query replies or on reply frames recorded from
+// the fdcanusb, checking that the parsers agree. With --fuzz it checks
+// register round trips and parses truncated and corrupted replies instead,
+// best built with -fsanitize=address to catch out-of-bounds reads.
+
+using namespace mjbots::moteus;
+using namespace protocol_checks;
+
+struct ReplySet
+{
+    std::string name;
+    std::vector<CanFrame> frames;
+};
+
+static void write_register(WriteCanFrame &writer, Register reg, double value, Resolution resolution)
+{
+    RegisterScale scale = GetRegisterScale(reg);
+    writer.WriteMapped(value, scale.int8, scale.int16, scale.int32, resolution);
+}
+
+// A reply to the default query, with the motion registers at one
+// resolution and the power registers at another. extra adds unrequested
+// PWM and phase voltage registers, as sent for a wider query.
+static CanFrame query_reply(Resolution motion, Resolution power, bool extra, double phase)
+{
+    CanFrame frame;
+    WriteCanFrame writer(&frame);
+
+    {
+        const Register registers[] = {kMode, kPosition, kVelocity, kTorque, kQCurrent, kDCurrent};
+        const double values[] = {static_cast<double>(Mode::kPosition), 1.2345 + phase, -3.5 * std::cos(phase), 0.42, 1.5, -0.1};
+        WriteCombiner<6> combiner(&writer, kReplyBase, kMode, {motion, motion, motion, motion, motion, motion});
+        for (int i = 0; i < 6; i++)
+        {
+            if (combiner.MaybeWrite())
+            {
+                write_register(writer, registers[i], values[i], motion);
+            }
+        }
+    }
+    {
+        const Register registers[] = {kRezeroState, kVoltage, kTemperature, kFault};
+        const double values[] = {1, 24.5, 36.0, 0};
+        WriteCombiner<4> combiner(&writer, kReplyBase, kRezeroState, {power, power, power, power});
+        for (int i = 0; i < 4; i++)
+        {
+            if (combiner.MaybeWrite())
+            {
+                write_register(writer, registers[i], values[i], power);
+            }
+        }
+    }
+    if (extra)
+    {
+        const Register registers[] = {kPwmPhaseA, kPwmPhaseB, kPwmPhaseC, static_cast<Register>(0x013), kVoltagePhaseA, kVoltagePhaseB, kVoltagePhaseC};
+        const double values[] = {0.1, -0.2, 0.3, 0, 12.0, 11.5, 12.5};
+        WriteCombiner<7> combiner(&writer, kReplyBase, kPwmPhaseA, {motion, motion, motion, motion, motion, motion, motion});
+        for (int i = 0; i < 7; i++)
+        {
+            if (combiner.MaybeWrite())
+            {
+                write_register(writer, registers[i], values[i], motion);
+            }
+        }
+    }
+    return frame;
+}
+
+static const char *resolution_names[] = {"int8", "int16", "int32", "float"};
+
+static std::vector<ReplySet> generated_replies()
+{
+    std::vector<ReplySet> sets = {
+        {"int8", {}},
+        {"int16 (default query)", {}},
+        {"int32", {}},
+        {"float", {}},
+        {"int16 with unrequested", {}},
+    };
+
+    for (int i = 0; i < 64; i++)
+    {
+        double phase = i * 0.1;
+        sets[0].frames.push_back(query_reply(Resolution::kInt8, Resolution::kInt8, false, phase));
+        sets[1].frames.push_back(query_reply(Resolution::kInt16, Resolution::kInt8, false, phase));
+        sets[2].frames.push_back(query_reply(Resolution::kInt32, Resolution::kInt32, false, phase));
+        sets[3].frames.push_back(query_reply(Resolution::kFloat, Resolution::kFloat, false, phase));
+        sets[4].frames.push_back(query_reply(Resolution::kInt16, Resolution::kInt8, true, phase));
+    }
+    return sets;
+}
+
+// Reads "rcv <id> <hex data> ..." lines as printed by the fdcanusb
+static bool recorded_replies(const std::string &path, ReplySet *set)
+{
+    std::ifstream file(path);
+
+    if (!file)
+    {
+        std::cerr << "Cannot open " << path << std::endl;
+        return false;
+    }
+
+    set->name = path;
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        std::istringstream words(line);
+        std::string command, id, hex;
+
+        if (!(words >> command >> id >> hex) || command != "rcv" || hex.size() / 2 > sizeof(CanFrame::data))
+        {
+            continue;
+        }
+
+        CanFrame frame;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2)
+        {
+            frame.data[frame.size++] = static_cast<uint8_t>(std::stoul(hex.substr(i, 2), nullptr, 16));
+        }
+        set->frames.push_back(frame);
+    }
+
+    if (set->frames.empty())
+    {
+        std::cerr << "No rcv lines in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Returns the mean time per frame in ns
+template <typename Parse>
+static double time_parser(const std::vector<CanFrame> &frames, uint64_t iterations, Parse parse)
+{
+    volatile double sink = 0.0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        for (const CanFrame &frame : frames)
+        {
+            sink = sink + parse(frame);
+        }
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (iterations * frames.size());
+}
+
+// Returns the mean time per encoded frame in ns, and its size
+template <typename Encode>
+static double time_encoder(uint64_t iterations, Encode encode, size_t *size)
+{
+    volatile uint8_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        CanFrame frame;
+        WriteCanFrame writer(&frame);
+        encode(&writer, i);
+        sink = sink + frame.data[frame.size - 1];
+        *size = frame.size;
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static void benchmark_encoding(uint64_t iterations)
+{
+    printf("%-24s", "Encoding");
+    for (const char *name : resolution_names)
+    {
+        printf(" %14s", name);
+    }
+    printf("\n");
+
+    const char *names[] = {"EmitPositionCommand", "EmitQueryCommand", "EmitWriteRegisters"};
+
+    for (int encoder = 0; encoder < 3; encoder++)
+    {
+        printf("%-24s", names[encoder]);
+
+        for (Resolution resolution : resolutions)
+        {
+            PositionResolution position_resolution;
+            position_resolution.position = position_resolution.velocity = position_resolution.feedforward_torque = resolution;
+            position_resolution.kp_scale = position_resolution.kd_scale = position_resolution.maximum_torque = resolution;
+            position_resolution.stop_position = position_resolution.watchdog_timeout = resolution;
+
+            QueryCommand query;
+            query.mode = query.position = query.velocity = query.torque = query.q_current = query.d_current = resolution;
+            query.rezero_state = query.voltage = query.temperature = query.fault = resolution;
+
+            // A command with telemetry reads, written as registers
+            RegisterAccess writes[] = {{kMode, Resolution::kInt8, static_cast<double>(Mode::kPosition)},
+                                       {kCommandPosition, resolution, NAN},
+                                       {kCommandVelocity, resolution, 0.0},
+                                       {kCommandFeedforwardTorque, resolution, 0.0},
+                                       {kCommandKpScale, resolution, 1.0},
+                                       {kCommandKdScale, resolution, 1.0},
+                                       {kCommandPositionMaxTorque, resolution, 1.0},
+                                       {kCommandStopPosition, resolution, NAN}};
+
+            size_t size = 0;
+            double ns = 0.0;
+
+            if (encoder == 0)
+            {
+                ns = time_encoder(iterations, [&](WriteCanFrame *writer, uint64_t i)
+                                  {
+                    PositionCommand command;
+                    command.velocity = 0.001 * (i & 1023);
+                    command.maximum_torque = 1.0;
+                    EmitPositionCommand(writer, command, position_resolution); }, &size);
+            }
+            else if (encoder == 1)
+            {
+                ns = time_encoder(iterations, [&](WriteCanFrame *writer, uint64_t)
+                                  { EmitQueryCommand(writer, query); }, &size);
+            }
+            else
+            {
+                ns = time_encoder(iterations, [&](WriteCanFrame *writer, uint64_t i)
+                                  {
+                    writes[2].value = 0.001 * (i & 1023);
+                    EmitWriteRegisters(writer, writes, 8); }, &size);
+            }
+
+            printf(" %6.1f ns (%2zu)", ns, size);
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+// Encodes random register values as a reply and checks that they parse
+// back, then parses truncated and corrupted copies of the reply and random
+// bytes. Returns the number of failures.
+static uint64_t fuzz(uint64_t iterations, unsigned int seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    uint64_t round_trip_errors = 0, disagreements = 0, exceptions = 0, overflows = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        std::vector<RegisterAccess> accesses;
+        for (Register reg : fuzz_registers)
+        {
+            if (random() % 4 == 0)
+            {
+                RegisterAccess access;
+                access.reg = reg;
+                access.resolution = resolutions[random() % 4];
+
+                access.value = 0.9 * value_range(reg, access.resolution) * unit(random);
+                accesses.push_back(access);
+            }
+        }
+
+        CanFrame frame;
+        WriteCanFrame writer(&frame);
+        bool complete = true;
+
+        try
+        {
+            detail::EmitRegisterAccesses(&writer, kReplyBase, accesses.data(), accesses.size(), true);
+        }
+        catch (const std::runtime_error &)
+        {
+            // Too many registers for one frame, fuzz the partial frame
+            complete = false;
+            overflows++;
+        }
+
+        if (complete)
+        {
+            std::vector<RegisterAccess> parsed = accesses;
+            ParseRegisterReply(frame.data, frame.size, parsed.data(), parsed.size());
+
+            for (size_t k = 0; k < accesses.size(); k++)
+            {
+                if (!round_trips(accesses[k], parsed[k].value))
+                {
+                    if (round_trip_errors++ < 10)
+                    {
+                        fprintf(stderr, "Register 0x%03x at resolution %s: wrote %g, read %g\n", accesses[k].reg,
+                                resolution_names[static_cast<int>(accesses[k].resolution)], accesses[k].value, parsed[k].value);
+                    }
+                }
+            }
+        }
+
+        // Truncate, corrupt or replace the reply
+        std::vector<uint8_t> bytes(frame.data, frame.data + frame.size);
+        switch (random() % 4)
+        {
+        case 0:
+            bytes.resize(random() % (bytes.size() + 1));
+            break;
+        case 1:
+            for (int flips = 1 + random() % 3; flips > 0 && !bytes.empty(); flips--)
+            {
+                bytes[random() % bytes.size()] ^= 1 << (random() % 8);
+            }
+            break;
+        case 2:
+            bytes.resize(random() % 65);
+            for (auto &byte : bytes)
+            {
+                byte = random();
+            }
+            break;
+        default:
+            break;
+        }
+
+        // An exactly sized heap copy, so a sanitizer sees any overread
+        std::unique_ptr<uint8_t[]> buffer(new uint8_t[bytes.size()]);
+        std::copy(bytes.begin(), bytes.end(), buffer.get());
+
+        try
+        {
+            if (!parsers_agree(buffer.get(), bytes.size(), accesses.data(), accesses.size()))
+            {
+                disagreements++;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            if (exceptions++ < 10)
+            {
+                fprintf(stderr, "Parsing a %zu byte reply threw: %s\n", bytes.size(), e.what());
+            }
+        }
+    }
+
+    printf("Fuzzed %lu replies (%lu too long for one frame): %lu round trip errors, %lu parser disagreements, %lu exceptions\n",
+           (unsigned long)iterations, (unsigned long)overflows, (unsigned long)round_trip_errors, (unsigned long)disagreements,
+           (unsigned long)exceptions);
+    return round_trip_errors + disagreements + exceptions;
+}
+
+int main(int argc, char *argv[])
+{
+    // Parse arguments
+    popl::OptionParser op("Allowed options");
+    auto help = op.add<popl::Switch>("h", "help", "produce help message");
+    auto input = op.add<popl::Value<std::string>>("i", "input", "fdcanusb output with rcv lines to parse instead of generated replies");
+    auto frame_count = op.add<popl::Value<unsigned int>>("n", "frames", "number of frames to encode or parse per benchmark", 2000000);
+    auto fuzz_count = op.add<popl::Value<unsigned int>>("", "fuzz", "check this many random, truncated and corrupted replies instead of benchmarking", 0);
+    auto seed = op.add<popl::Value<unsigned int>>("", "seed", "random seed for --fuzz", 1);
+
+    try
+    {
+        op.parse(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << std::endl;
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (help->is_set())
+    {
+        std::cerr << op << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (fuzz_count->value() > 0)
+    {
+        return fuzz(fuzz_count->value(), seed->value()) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    std::vector<ReplySet> sets;
+
+    if (input->is_set())
+    {
+        sets.emplace_back();
+        if (!recorded_replies(input->value(), &sets.back()))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        sets = generated_replies();
+    }
+
+    if (!input->is_set())
+    {
+        benchmark_encoding(frame_count->value());
+    }
+
+    bool mismatch = false;
+
+    printf("%-24s %6s %18s %18s %8s\n", "Replies", "bytes", "ParseQueryResult", "ParseQueryState", "speedup");
+
+    for (const ReplySet &set : sets)
+    {
+        size_t bytes = 0;
+        for (const CanFrame &frame : set.frames)
+        {
+            bytes += frame.size;
+
+            QueryResult result = ParseQueryResult(frame.data, frame.size);
+            QueryState state = ParseQueryState(frame.data, frame.size);
+            if (!agree(result, state))
+            {
+                mismatch = true;
+            }
+        }
+
+        uint64_t iterations = std::max<uint64_t>(1, frame_count->value() / set.frames.size());
+
+        double result_ns = time_parser(set.frames, iterations, [](const CanFrame &frame)
+                                       {
+            QueryResult result = ParseQueryResult(frame.data, frame.size);
+            return result.position + result.voltage + result.fault; });
+        double state_ns = time_parser(set.frames, iterations, [](const CanFrame &frame)
+                                      {
+            QueryState state = ParseQueryState(frame.data, frame.size);
+            return static_cast<double>(state.position + state.voltage + state.fault); });
+
+        printf("%-24s %6.1f %15.1f ns %15.1f ns %7.1fx\n", set.name.c_str(), static_cast<double>(bytes) / set.frames.size(),
+               result_ns, state_ns, result_ns / state_ns);
+    }
+
+    if (mismatch)
+    {
+        std::cerr << "Parsers disagree on some frames" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
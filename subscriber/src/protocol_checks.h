@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <moteus_protocol.h>
+
+// Consistency checks of the moteus codec, shared by protocol_bench --fuzz
+// and the moteus_fuzz libFuzzer harness.
+
+namespace protocol_checks
+{
+using namespace mjbots::moteus;
+
+static const Resolution resolutions[] = {Resolution::kInt8, Resolution::kInt16, Resolution::kInt32, Resolution::kFloat};
+
+// Registers of the map that fit into the single byte register framing
+static const Register fuzz_registers[] = {
+    kMode, kPosition, kVelocity, kTorque, kQCurrent, kDCurrent, kAbsPosition, kRezeroState, kVoltage, kTemperature,
+    kFault, kPwmPhaseA, kPwmPhaseB, kPwmPhaseC, kVoltagePhaseA, kVoltagePhaseB, kVoltagePhaseC, kVFocTheta,
+    kVFocVoltage, kVoltageDqD, kVoltageDqQ, kCommandQCurrent, kCommandDCurrent, kCommandPosition, kCommandVelocity,
+    kCommandFeedforwardTorque, kCommandKpScale, kCommandKdScale, kCommandPositionMaxTorque, kCommandStopPosition,
+    kCommandTimeout, kPositionKp, kPositionKi, kPositionKd, kPositionFeedforward, kPositionCommandTorque,
+    kStayWithinLower, kStayWithinUpper, kStayWithinFeedforward, kStayWithinKpScale, kStayWithinKdScale,
+    kStayWithinMaxTorque, kStayWithinTimeout};
+
+inline bool same(double expected, float value)
+{
+    if (expected == value)
+    {
+        return true;
+    }
+    if (std::isnan(expected) || std::isnan(value))
+    {
+        return std::isnan(expected) && std::isnan(value);
+    }
+    return std::abs(expected - value) <= 1e-6 * std::max(1.0, std::abs(expected));
+}
+
+inline bool agree(const QueryResult &result, const QueryState &state)
+{
+    return static_cast<int>(result.mode) == state.mode && same(result.position, state.position) && same(result.velocity, state.velocity) &&
+           same(result.torque, state.torque) && same(result.q_current, state.q_current) && same(result.d_current, state.d_current) &&
+           result.rezero_state == state.rezero_state && same(result.voltage, state.voltage) &&
+           same(result.temperature, state.temperature) && result.fault == state.fault;
+}
+
+// Largest value a register can be written with at a resolution, inside the
+// range of the integer encodings
+inline double value_range(Register reg, Resolution resolution)
+{
+    RegisterScale scale = GetRegisterScale(reg);
+    return resolution == Resolution::kInt8    ? scale.int8 * 127
+           : resolution == Resolution::kInt16 ? scale.int16 * 32767
+           : resolution == Resolution::kInt32 ? std::min(scale.int32 * 2147483647.0, 1e6)
+                                              : 1e3;
+}
+
+// True if a value read back is the written one, within one step of its
+// resolution
+inline bool round_trips(const RegisterAccess &written, double read)
+{
+    RegisterScale scale = GetRegisterScale(written.reg);
+    double step = written.resolution == Resolution::kInt8    ? scale.int8
+                  : written.resolution == Resolution::kInt16 ? scale.int16
+                  : written.resolution == Resolution::kInt32 ? scale.int32
+                                                             : 1e-6 * std::abs(written.value);
+    return std::abs(read - written.value) <= step;
+}
+
+// Parses any bytes with all reply parsers. Returns false if the two query
+// parsers disagree; exceptions of the parsers are passed on. Integer
+// fields of garbage may not be representable, so only the scaled fields
+// are compared.
+inline bool parsers_agree(const uint8_t *data, size_t size, RegisterAccess *accesses, size_t count)
+{
+    QueryResult result = ParseQueryResult(data, size);
+    QueryState state = ParseQueryState(data, size);
+    ParseRegisterReply(data, size, accesses, count);
+
+    return same(result.position, state.position) && same(result.velocity, state.velocity) &&
+           same(result.torque, state.torque) && same(result.q_current, state.q_current) &&
+           same(result.d_current, state.d_current) && same(result.voltage, state.voltage) &&
+           same(result.temperature, state.temperature);
+}
+} // namespace protocol_checks
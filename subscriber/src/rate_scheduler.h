@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Picks the control period from the measured cost of the control cycles.
+//
+// Cycles are scheduled on absolute deadlines. Every `window` cycles the
+// scheduler looks at the cycle costs: the period must cover the 95th
+// percentile of a command cycle and the average cost including telemetry
+// reads, plus headroom. When that exceeds the target period, telemetry is
+// slowed down first (up to max_telemetry_divider) and only then the
+// command period is lengthened. When load drops, the command period is
+// restored first, then telemetry.
+//
+// Cycles cut off at their deadline have no measured cost, they count as
+// twice the time they ran. If more than 5% of a window was cut off, the
+// command period is lengthened right away, as slower telemetry would not
+// help, until the cycles fit.
+//
+// Time is passed in explicitly, the caller does the sleeping.
+class RateScheduler
+{
+public:
+    struct Config
+    {
+        uint64_t target_period_us = 1000;   // fastest period to aim for
+        uint64_t max_period_us = 20000;     // never run slower than this
+        uint64_t telemetry_period_us = 0;   // 0 disables telemetry cycles
+        double headroom = 0.25;             // fraction of the period kept free
+        unsigned int window = 256;          // cycles between adaptations
+        unsigned int max_telemetry_divider = 64;
+    };
+
+    struct Report
+    {
+        double achieved_rate_hz = 0.0;
+        uint64_t period_us = 0;
+        uint64_t cost_p95_us = 0;
+        uint64_t jitter_p50_us = 0;         // start lateness vs deadline
+        uint64_t jitter_p99_us = 0;
+        uint64_t overruns = 0;              // in the last window
+        double telemetry_rate_hz = 0.0;
+    };
+
+    explicit RateScheduler(const Config &config)
+        : config_(config), period_us_(config.target_period_us)
+    {
+        costs_.reserve(config_.window);
+        lateness_.reserve(config_.window);
+    }
+
+    uint64_t period_us() const { return period_us_; }
+    uint64_t total_overruns() const { return total_overruns_; }
+    const Report &report() const { return report_; }
+
+    // Start time of the next cycle, sleep until then
+    uint64_t next_start_us(uint64_t now_us)
+    {
+        if (next_start_us_ == 0)
+        {
+            next_start_us_ = now_us;
+        }
+        return next_start_us_;
+    }
+
+    // Call at the start of the cycle. Returns true if this cycle should
+    // also read telemetry.
+    bool start(uint64_t now_us)
+    {
+        if (window_start_us_ == 0)
+        {
+            window_start_us_ = now_us;
+        }
+
+        lateness_.push_back(now_us > next_start_us_ ? now_us - next_start_us_ : 0);
+        start_us_ = now_us;
+
+        telemetry_ = config_.telemetry_period_us > 0 && now_us >= next_telemetry_us_;
+        if (telemetry_)
+        {
+            next_telemetry_us_ = now_us + config_.telemetry_period_us * telemetry_divider_;
+        }
+        return telemetry_;
+    }
+
+    // Call at the end of the cycle, cut_off if it was abandoned at its
+    // deadline. Returns true if the period or the telemetry rate changed.
+    bool finish(uint64_t now_us, bool cut_off = false)
+    {
+        uint64_t cost_us = now_us - start_us_;
+        if (cut_off)
+        {
+            cost_us *= 2;
+            cut_offs_++;
+        }
+
+        if (!telemetry_)
+        {
+            costs_.push_back(cost_us);
+        }
+        total_cost_us_ += cost_us;
+
+        // Next deadline; if we are already past it, skip ahead instead of
+        // bursting to catch up
+        next_start_us_ += period_us_;
+        if (now_us > next_start_us_)
+        {
+            overruns_++;
+            total_overruns_++;
+            next_start_us_ = now_us;
+        }
+
+        if (lateness_.size() < config_.window)
+        {
+            return false;
+        }
+        return adapt(now_us);
+    }
+
+private:
+    static uint64_t percentile(std::vector<uint64_t> &values, double q)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+        size_t index = std::min(values.size() - 1, static_cast<size_t>(q * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+
+    bool adapt(uint64_t now_us)
+    {
+        size_t cycles = lateness_.size();
+
+        report_.achieved_rate_hz = now_us > window_start_us_ ? cycles * 1e6 / (now_us - window_start_us_) : 0.0;
+        report_.cost_p95_us = percentile(costs_, 0.95);
+        report_.jitter_p50_us = percentile(lateness_, 0.50);
+        report_.jitter_p99_us = percentile(lateness_, 0.99);
+        report_.overruns = overruns_;
+
+        // Sustainable period from the command cycle tail and the average
+        // load including telemetry
+        double mean_cost = static_cast<double>(total_cost_us_) / cycles;
+        double required = std::max<double>(report_.cost_p95_us, mean_cost) * (1.0 + config_.headroom);
+        uint64_t required_us = std::min<uint64_t>(std::ceil(required), config_.max_period_us);
+
+        uint64_t old_period_us = period_us_;
+        unsigned int old_divider = telemetry_divider_;
+        bool telemetry_enabled = config_.telemetry_period_us > 0;
+
+        if (required_us > period_us_)
+        {
+            // Saturated: give up telemetry rate before command rate
+            bool cut_off = cut_offs_ * 20 > cycles;
+            if (telemetry_enabled && telemetry_divider_ < config_.max_telemetry_divider && !cut_off)
+            {
+                telemetry_divider_ *= 2;
+            }
+            else
+            {
+                period_us_ = required_us;
+            }
+        }
+        else if (period_us_ > config_.target_period_us && required_us < period_us_)
+        {
+            // Recover command rate first
+            period_us_ = std::max(required_us, config_.target_period_us);
+        }
+        else if (telemetry_divider_ > 1 && required_us <= config_.target_period_us)
+        {
+            telemetry_divider_ /= 2;
+        }
+
+        report_.period_us = period_us_;
+        report_.telemetry_rate_hz = telemetry_enabled ? 1e6 / (config_.telemetry_period_us * telemetry_divider_) : 0.0;
+
+        costs_.clear();
+        lateness_.clear();
+        overruns_ = 0;
+        cut_offs_ = 0;
+        total_cost_us_ = 0;
+        window_start_us_ = now_us;
+
+        return period_us_ != old_period_us || telemetry_divider_ != old_divider;
+    }
+
+    const Config config_;
+    uint64_t period_us_;
+    unsigned int telemetry_divider_ = 1;
+    uint64_t next_start_us_ = 0;
+    uint64_t next_telemetry_us_ = 0;
+    uint64_t start_us_ = 0;
+    bool telemetry_ = false;
+
+    // Current window
+    std::vector<uint64_t> costs_;
+    std::vector<uint64_t> lateness_;
+    uint64_t window_start_us_ = 0;
+    uint64_t total_cost_us_ = 0;
+    uint64_t overruns_ = 0;
+    uint64_t cut_offs_ = 0;
+    uint64_t total_overruns_ = 0;
+
+    Report report_;
+};
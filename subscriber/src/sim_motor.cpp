@@ -0,0 +1,139 @@
+#include "sim_motor.h"
+
+#include <algorithm>
+#include <cmath>
+
+SimulatedRobot::SimulatedRobot(size_t wheels, const WheelModel &model, std::function<uint64_t()> clock, uint64_t step_us)
+    : model_(model), clock_(std::move(clock)), step_us_(std::max<uint64_t>(step_us, 1)), time_us_(clock_()), wheels_(wheels)
+{
+    for (auto &wheel : wheels_)
+    {
+        wheel.temperature = model_.ambient;
+    }
+}
+
+void SimulatedRobot::update()
+{
+    uint64_t now_us = clock_();
+
+    while (time_us_ + step_us_ <= now_us)
+    {
+        step(step_us_ * 1e-6);
+        time_us_ += step_us_;
+    }
+}
+
+void SimulatedRobot::step(double dt)
+{
+    for (auto &wheel : wheels_)
+    {
+        double torque = 0.0;
+
+        if (wheel.enabled)
+        {
+            // moteus position mode with position = NAN: the control
+            // position integrates the velocity command
+            wheel.control_position += wheel.velocity_command * dt;
+
+            torque = model_.kp * wheel.kp_scale * (wheel.control_position - wheel.position) +
+                     model_.kd * wheel.kd_scale * (wheel.velocity_command - wheel.velocity) +
+                     wheel.feedforward_torque;
+
+            double limit = std::min(wheel.max_torque, model_.torque_limit);
+            torque = std::max(-limit, std::min(limit, torque));
+        }
+
+        double acceleration = (torque - model_.friction * wheel.velocity) / (model_.inertia * 2 * M_PI);
+
+        wheel.velocity += acceleration * dt;
+        wheel.position += wheel.velocity * dt;
+        wheel.torque = torque;
+
+        double target_temperature = model_.ambient + model_.thermal_gain * torque * torque;
+        wheel.temperature += (target_temperature - wheel.temperature) * dt / model_.thermal_time;
+    }
+}
+
+void SimulatedRobot::command(size_t i, double velocity, double max_torque, double feedforward_torque, double kp_scale, double kd_scale)
+{
+    update();
+
+    Wheel &wheel = wheels_[i];
+    if (!wheel.enabled)
+    {
+        wheel.control_position = wheel.position;
+        wheel.enabled = true;
+    }
+    wheel.velocity_command = velocity;
+    wheel.max_torque = max_torque;
+    wheel.feedforward_torque = feedforward_torque;
+    wheel.kp_scale = kp_scale;
+    wheel.kd_scale = kd_scale;
+
+}
+
+void SimulatedRobot::stop(size_t i)
+{
+    update();
+    wheels_[i].enabled = false;
+}
+
+void SimulatedRobot::read(size_t i, State &curr_state)
+{
+    update();
+
+    const Wheel &wheel = wheels_[i];
+    curr_state.position = wheel.position;
+    curr_state.velocity = wheel.velocity;
+    curr_state.torque = wheel.torque;
+    curr_state.voltage = model_.voltage;
+    curr_state.temperature = wheel.temperature;
+    curr_state.fault = 0;
+    curr_state.mode = wheel.enabled ? static_cast<double>(mjbots::moteus::Mode::kPosition)
+                                    : static_cast<double>(mjbots::moteus::Mode::kStopped);
+
+}
+
+void SimulatedMotorGroup::SetPositionCommand(size_t i, double, double velocity, double max_torque,
+                                             double feedforward_torque, double kp_scale, double kd_scale)
+{
+    commands_[i] = {false, velocity, max_torque, feedforward_torque, kp_scale, kd_scale};
+}
+
+bool SimulatedMotorGroup::Cycle(bool, int64_t timeout_us, bool *ok)
+{
+    for (size_t i = 0; i < commands_.size(); i++)
+    {
+        const Command &c = commands_[i];
+        if (c.stop)
+        {
+            robot_.stop(i);
+        }
+        else
+        {
+            robot_.command(i, c.velocity, c.max_torque, c.feedforward_torque, c.kp_scale, c.kd_scale);
+        }
+    }
+
+    // On the wall clock the robot answers at once
+    uint64_t round_trip_us = 0;
+    if (virtual_clock_)
+    {
+        bool slow = bus_.slow_fraction > 0.0 && std::uniform_real_distribution<double>()(random_) < bus_.slow_fraction;
+        round_trip_us = slow ? bus_.slow_round_trip_us : bus_.round_trip_us;
+    }
+
+    bool on_time = timeout_us < 0 || round_trip_us <= static_cast<uint64_t>(timeout_us);
+    uint64_t cycle_us = on_time ? round_trip_us : timeout_us;
+    if (virtual_clock_)
+    {
+        virtual_clock_->advance(cycle_us);
+    }
+
+    for (size_t i = 0; i < commands_.size(); i++)
+    {
+        ok[i] = on_time;
+        reply_time_us_[i] = cycle_us;
+    }
+    return on_time;
+}
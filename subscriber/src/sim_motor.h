@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+#include "motor_backend.h"
+
+// In-process model of a robot with independent wheels driven by moteus
+// controllers in position mode. Time comes from a clock function, so the
+// simulation runs either against the wall clock or a VirtualClock.
+
+struct WheelModel
+{
+    double inertia = 0.004;        // reflected inertia at the motor (kg m^2)
+    double friction = 0.02;        // viscous friction (Nm per rev/s)
+    double kp = 1.0;               // position gain at kp_scale 1 (Nm/rev)
+    double kd = 0.05;              // velocity gain at kd_scale 1 (Nm per rev/s)
+    double torque_limit = 2.0;     // firmware torque limit (Nm)
+    double voltage = 24.0;         // bus voltage (V)
+    double ambient = 25.0;         // temperature with no load (C)
+    double thermal_gain = 5.0;     // steady state heating (C/Nm^2)
+    double thermal_time = 60.0;    // thermal time constant (s)
+};
+
+// Simulated time, advanced explicitly by the caller
+class VirtualClock
+{
+public:
+    uint64_t now_us() const { return now_us_; }
+    void advance(uint64_t us) { now_us_ += us; }
+
+private:
+    uint64_t now_us_ = 0;
+};
+
+class SimulatedRobot
+{
+public:
+    struct Wheel
+    {
+        bool enabled = false;      // position mode, otherwise stopped
+        double velocity_command = 0.0;
+        double control_position = 0.0;
+        double max_torque = 0.0;
+        double feedforward_torque = 0.0;
+        double kp_scale = 1.0;
+        double kd_scale = 1.0;
+
+        double position = 0.0;     // rev
+        double velocity = 0.0;     // rev/s
+        double torque = 0.0;       // Nm
+        double temperature = 0.0;  // C
+    };
+
+    // step_us: integration step
+    SimulatedRobot(size_t wheels, const WheelModel &model, std::function<uint64_t()> clock, uint64_t step_us = 50);
+
+    size_t size() const { return wheels_.size(); }
+    const Wheel &wheel(size_t i) const { return wheels_[i]; }
+
+    // Integrates the model up to the current clock time
+    void update();
+
+    void command(size_t i, double velocity, double max_torque, double feedforward_torque, double kp_scale, double kd_scale);
+    void stop(size_t i);
+    void read(size_t i, State &curr_state);
+
+private:
+    void step(double dt);
+
+    const WheelModel model_;
+    std::function<uint64_t()> clock_;
+    const uint64_t step_us_;
+    uint64_t time_us_;
+    std::vector<Wheel> wheels_;
+};
+
+// Round trips of simulated motor cycles: a fraction of the cycles, drawn
+// from a fixed seed, takes slow_round_trip_us instead, e.g. to exercise
+// the cycle deadline and degraded mode
+struct SimulatedBus
+{
+    uint64_t round_trip_us = 0;
+    double slow_fraction = 0.0;
+    uint64_t slow_round_trip_us = 0;
+};
+
+// The wheels of a SimulatedRobot as a motor group. Like a MoteusGroup
+// cycle, a cycle applies the commands of all wheels at once and takes one
+// round trip, which is spent on the virtual clock if there is one. A round
+// trip longer than the cycle deadline is cut off there, without replies.
+// The state of the wheels is read without a round trip, as it arrives with
+// the replies.
+class SimulatedMotorGroup : public MotorGroup
+{
+public:
+    SimulatedMotorGroup(SimulatedRobot &robot, VirtualClock *virtual_clock = nullptr, const SimulatedBus &bus = SimulatedBus())
+        : robot_(robot), virtual_clock_(virtual_clock), bus_(bus), commands_(robot.size()), reply_time_us_(robot.size()) {}
+
+    size_t size() const override { return robot_.size(); }
+
+    void SetPositionCommand(size_t i, double stop_position, double velocity, double max_torque,
+                            double feedforward_torque, double kp_scale, double kd_scale) override;
+    void SetStopCommand(size_t i) override { commands_[i].stop = true; }
+    bool Cycle(bool reply, int64_t timeout_us, bool *ok) override;
+    uint64_t reply_time_us(size_t i) const override { return reply_time_us_[i]; }
+    void ReadState(size_t i, State &curr_state) override { robot_.read(i, curr_state); }
+
+private:
+    struct Command
+    {
+        bool stop = true;
+        double velocity, max_torque, feedforward_torque, kp_scale, kd_scale;
+    };
+
+    SimulatedRobot &robot_;
+    VirtualClock *const virtual_clock_;
+    const SimulatedBus bus_;
+    std::mt19937 random_;
+    std::vector<Command> commands_;
+    std::vector<uint64_t> reply_time_us_;
+};